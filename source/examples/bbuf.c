@@ -0,0 +1,368 @@
+/*
+** bbuf.c -- the classic bounded buffer: many producers and consumers
+** sharing a shmdemo.c-style segment, two ways:
+**
+**   sysv_3sem  a semdemo.c-style semaphore set of three: "empty" counts
+**              free slots, "full" counts filled ones, and "mutex" guards
+**              the indices.  A producer takes an empty slot and the mutex
+**              in a single semop() on both, fills the slot, and gives
+**              back the mutex and a full slot in another; a consumer
+**              does the mirror image.  Two system calls per record.
+**   mpmc       mpmc.h, lock-free with a sequence number per slot; no
+**              system calls at all
+**
+** For 1, 2, 4, ... producers and as many consumers, the producers send
+** -n records between them and the consumers take them out in whatever
+** order they come.  Every 16th record's trip through the buffer is
+** timed.  Prints CSV (see bench.h), and complains if any record went
+** missing or came out twice.
+**
+** usage: bbuf [-m max_procs] [-n records] [-c capacity] [-s size]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+
+#include "bench.h"
+#include "mpmc.h"
+
+#define MAX_PROCS 64       /* on each side */
+#define DEFAULT_RECS 200000
+#define DEFAULT_CAP 64
+#define SAMPLE_EVERY 16
+#define MAX_SAMPLES 8192   /* per consumer */
+#define CACHELINE 64
+#define MAX_RECSIZE 65536  /* records get copied through stack buffers */
+#define PILL UINT32_MAX    /* producer id that means "go home" */
+
+enum { SYSV_3SEM, MPMC };
+
+static const char *mech_names[] = { "sysv_3sem", "mpmc" };
+
+/* semaphore numbers in the set */
+enum { EMPTY, FULL, MUTEX };
+
+struct rec {
+	uint64_t sent_ns;
+	uint32_t producer;
+	uint32_t seq;
+	/* and filler out to -s bytes */
+};
+
+/* the SysV bounded buffer; head and tail are guarded by MUTEX */
+struct bbuf {
+	uint32_t cap, recsize;
+	uint32_t head, tail;
+	unsigned char data[];
+};
+
+/*
+** The segment: bookkeeping for the benchmark, then whichever buffer
+** we're running.
+*/
+struct shared {
+	_Atomic int ready, go;
+
+	struct {
+		_Alignas(CACHELINE) unsigned long got;
+		uint64_t seqsum;
+		size_t nsamples;
+		uint64_t samples[MAX_SAMPLES];
+	} consumer[MAX_PROCS];
+
+	_Alignas(CACHELINE) unsigned char buf[];
+};
+
+static struct shared *sh;
+static int semid;
+static size_t recsize = 64;
+static uint32_t cap = DEFAULT_CAP;
+
+static void semop_or_die(struct sembuf *sops, size_t n)
+{
+	while (semop(semid, sops, n) == -1)
+		if (errno != EINTR) {
+			perror("semop");
+			exit(1);
+		}
+}
+
+/*
+** No SEM_UNDO here: "empty" and "full" are counts handed from one
+** process to another, and undoing a dead process's share of them would
+** throw the counts off.
+*/
+static void bbuf_put(struct bbuf *b, const void *rec)
+{
+	struct sembuf down[2] = { { EMPTY, -1, 0 }, { MUTEX, -1, 0 } };
+	struct sembuf up[2] = { { MUTEX, 1, 0 }, { FULL, 1, 0 } };
+
+	semop_or_die(down, 2);  /* a free slot and the lock, all at once */
+	memcpy(b->data + (size_t)b->head * b->recsize, rec, b->recsize);
+	b->head = (b->head + 1) % b->cap;
+	semop_or_die(up, 2);
+}
+
+static void bbuf_get(struct bbuf *b, void *rec)
+{
+	struct sembuf down[2] = { { FULL, -1, 0 }, { MUTEX, -1, 0 } };
+	struct sembuf up[2] = { { MUTEX, 1, 0 }, { EMPTY, 1, 0 } };
+
+	semop_or_die(down, 2);
+	memcpy(rec, b->data + (size_t)b->tail * b->recsize, b->recsize);
+	b->tail = (b->tail + 1) % b->cap;
+	semop_or_die(up, 2);
+}
+
+static void put(int mech, const void *rec)
+{
+	if (mech == SYSV_3SEM) bbuf_put((struct bbuf *)sh->buf, rec);
+	else mpmc_push((struct mpmc *)sh->buf, rec);
+}
+
+static void get(int mech, void *rec)
+{
+	if (mech == SYSV_3SEM) bbuf_get((struct bbuf *)sh->buf, rec);
+	else mpmc_pop((struct mpmc *)sh->buf, rec);
+}
+
+static void wait_for_go(void)
+{
+	atomic_fetch_add(&sh->ready, 1);
+	while (!atomic_load(&sh->go))
+		sched_yield();
+}
+
+static void producer(int mech, uint32_t id, uint32_t count)
+{
+	unsigned char buf[recsize];
+	struct rec *r = (struct rec *)buf;
+	uint32_t i;
+
+	memset(buf, 'x', recsize);
+	r->producer = id;
+
+	wait_for_go();
+
+	for (i = 0; i < count; i++) {
+		r->seq = i;
+		r->sent_ns = i % SAMPLE_EVERY == 0 ? now_ns() : 0;
+		put(mech, buf);
+	}
+}
+
+static void consumer(int mech, int id)
+{
+	unsigned char buf[recsize];
+	struct rec *r = (struct rec *)buf;
+	unsigned long got = 0;
+	uint64_t seqsum = 0;
+	size_t nsamples = 0;
+
+	wait_for_go();
+
+	for (;;) {
+		get(mech, buf);
+		if (r->producer == PILL) break;
+
+		if (r->sent_ns != 0 && nsamples < MAX_SAMPLES)
+			sh->consumer[id].samples[nsamples++] = now_ns() - r->sent_ns;
+		seqsum += r->seq;
+		got++;
+	}
+
+	sh->consumer[id].got = got;
+	sh->consumer[id].seqsum = seqsum;
+	sh->consumer[id].nsamples = nsamples;
+}
+
+static pid_t spawn(int mech, int is_producer, int id, uint32_t count)
+{
+	pid_t pid;
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			if (is_producer) producer(mech, id, count);
+			else consumer(mech, id);
+			_exit(0);
+	}
+
+	return pid;
+}
+
+static void reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "bbuf: a child failed\n");
+		exit(1);
+	}
+}
+
+/*
+** run() -- one round: n producers, n consumers, nrecs records
+*/
+static void run(int mech, int n, uint32_t nrecs)
+{
+	union { unsigned short *array; } arg;  /* union semun, cut down */
+	unsigned short vals[3] = { 0, 0, 1 };
+	unsigned long got = 0;
+	uint64_t elapsed, seqsum = 0, want = 0;
+	pid_t prod[MAX_PROCS], cons[MAX_PROCS];
+	unsigned char pill[recsize];
+	struct lat l;
+	char name[64];
+	int i;
+
+	memset(sh, 0, sizeof *sh);
+
+	if (mech == SYSV_3SEM) {
+		struct bbuf *b = (struct bbuf *)sh->buf;
+
+		b->cap = cap;
+		b->recsize = recsize;
+		b->head = b->tail = 0;
+
+		vals[EMPTY] = cap;
+		arg.array = vals;
+		if (semctl(semid, 0, SETALL, arg) == -1) {
+			perror("semctl");
+			exit(1);
+		}
+	} else
+		mpmc_init((struct mpmc *)sh->buf, cap, recsize);
+
+	for (i = 0; i < n; i++) {
+		/* the first producers get one extra if it doesn't divide */
+		uint32_t count = nrecs / n + ((uint32_t)i < nrecs % n);
+
+		want += (uint64_t)count * (count - 1) / 2;  /* 0 + 1 + ... */
+
+		prod[i] = spawn(mech, 1, i, count);
+		cons[i] = spawn(mech, 0, i, 0);
+	}
+
+	while (atomic_load(&sh->ready) < 2 * n)
+		sched_yield();
+
+	elapsed = now_ns();
+	atomic_store(&sh->go, 1);
+
+	/* once the producers are done, send each consumer home */
+	for (i = 0; i < n; i++)
+		reap(prod[i]);
+
+	memset(pill, 0, recsize);
+	((struct rec *)pill)->producer = PILL;
+	for (i = 0; i < n; i++)
+		put(mech, pill);
+
+	for (i = 0; i < n; i++)
+		reap(cons[i]);
+	elapsed = now_ns() - elapsed;
+
+	lat_init(&l, (size_t)n * MAX_SAMPLES);
+	for (i = 0; i < n; i++) {
+		size_t j;
+
+		got += sh->consumer[i].got;
+		seqsum += sh->consumer[i].seqsum;
+		for (j = 0; j < sh->consumer[i].nsamples; j++)
+			lat_add(&l, sh->consumer[i].samples[j]);
+	}
+
+	snprintf(name, sizeof name, "%s_%dp%dc", mech_names[mech], n, n);
+	bench_csv_row(name, recsize, got, elapsed, &l);
+	fflush(stdout);
+	lat_free(&l);
+
+	if (got != nrecs || seqsum != want)
+		fprintf(stderr, "%s: got %lu records (sequence sum %llu), wanted "
+			"%u (%llu)!\n", name, got, (unsigned long long)seqsum, nrecs,
+			(unsigned long long)want);
+}
+
+int main(int argc, char *argv[])
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t nrecs = DEFAULT_RECS;
+	size_t bufsize, b2;
+	int opt, shmid, mech, n, maxp = 0;
+
+	while ((opt = getopt(argc, argv, "m:n:c:s:")) != -1) {
+		switch (opt) {
+			case 'm': maxp = atoi(optarg); break;
+			case 'n': nrecs = strtoul(optarg, NULL, 0); break;
+			case 'c': cap = strtoul(optarg, NULL, 0); break;
+			case 's': recsize = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: bbuf [-m max_procs] [-n records] "
+					"[-c capacity] [-s size]\n");
+				exit(1);
+		}
+	}
+
+	if (maxp <= 0) maxp = ncpu > 2 ? ncpu / 2 : 2;
+	if (maxp > MAX_PROCS) maxp = MAX_PROCS;
+	if (recsize < sizeof(struct rec)) recsize = sizeof(struct rec);
+	if (recsize > MAX_RECSIZE) {
+		fprintf(stderr, "bbuf: record size can be at most %d\n",
+			MAX_RECSIZE);
+		exit(1);
+	}
+
+	/* mpmc.h needs a power of two, so both get one; "empty" starts at
+	   cap, and a semaphore tops out at SEMVMX (32767) */
+	if (cap == 0 || (cap & (cap - 1)) != 0 || cap > 16384) {
+		fprintf(stderr, "bbuf: capacity must be a power of two up to "
+			"16384\n");
+		exit(1);
+	}
+
+	bufsize = sizeof(struct bbuf) + (size_t)cap * recsize;
+	if ((b2 = mpmc_bytes(cap, recsize)) > bufsize) bufsize = b2;
+
+	/* private segment and semaphores; they go away when we're done */
+	if ((shmid = shmget(IPC_PRIVATE, sizeof *sh + bufsize, 0600)) == -1) {
+		perror("shmget");
+		exit(1);
+	}
+	sh = shmat(shmid, NULL, 0);
+	shmctl(shmid, IPC_RMID, NULL);  /* gone once everyone detaches */
+	if (sh == (void *)-1) {
+		perror("shmat");
+		exit(1);
+	}
+
+	if ((semid = semget(IPC_PRIVATE, 3, 0600)) == -1) {
+		perror("semget");
+		exit(1);
+	}
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (mech = SYSV_3SEM; mech <= MPMC; mech++)
+		for (n = 1; n <= maxp; n = n * 2 > maxp && n < maxp ? maxp : n * 2)
+			run(mech, n, nrecs);
+
+	semctl(semid, 0, IPC_RMID);
+	shmdt(sh);
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/*
+** bench.h -- timing, latency percentiles, and CSV output shared by the
+** benchmark examples (ipcbench.c and friends)
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+/*
+** now_ns() -- monotonic clock in nanoseconds
+*/
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+** A bag of latency samples.  We keep every sample and sort at the end,
+** which is plenty fast for the sample counts the examples use.
+*/
+struct lat {
+	uint64_t *ns;
+	size_t n, cap;
+};
+
+static inline void lat_init(struct lat *l, size_t cap)
+{
+	l->n = 0;
+	l->cap = cap;
+	if ((l->ns = malloc(cap * sizeof *l->ns)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+}
+
+static inline void lat_add(struct lat *l, uint64_t ns)
+{
+	if (l->n < l->cap) l->ns[l->n++] = ns;
+}
+
+static inline void lat_free(struct lat *l)
+{
+	free(l->ns);
+	l->ns = NULL;
+	l->n = l->cap = 0;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+** lat_pct() -- the p-th percentile (0.0-1.0).  Call lat_sort() first.
+*/
+static inline void lat_sort(struct lat *l)
+{
+	qsort(l->ns, l->n, sizeof *l->ns, lat_cmp);
+}
+
+static inline uint64_t lat_pct(const struct lat *l, double p)
+{
+	size_t i;
+
+	if (l->n == 0) return 0;
+
+	i = (size_t)(p * (l->n - 1) + 0.5);
+
+	return l->ns[i];
+}
+
+/*
+** CSV output.  Every benchmark prints the same columns so the files can
+** be concatenated and compared across kernels and hosts.  Latency
+** columns are left empty when a run doesn't measure latency.
+*/
+static inline void bench_csv_header(void)
+{
+	printf("host,kernel,mechanism,size,msgs,msgs_per_s,mb_per_s,"
+		"p50_ns,p99_ns,p999_ns\n");
+}
+
+static inline void bench_csv_row(const char *mech, size_t size, size_t msgs,
+	uint64_t elapsed_ns, struct lat *l)
+{
+	static struct utsname u;
+	double secs = elapsed_ns / 1e9;
+
+	if (u.sysname[0] == '\0' && uname(&u) == -1)
+		strcpy(u.nodename, "unknown");
+
+	if (secs <= 0) secs = 1e-9;
+
+	printf("%s,%s,%s,%zu,%zu,%.0f,%.2f,", u.nodename, u.release, mech,
+		size, msgs, msgs / secs, (double)msgs * size / secs / 1e6);
+
+	if (l != NULL && l->n > 0) {
+		lat_sort(l);
+		printf("%llu,%llu,%llu\n",
+			(unsigned long long)lat_pct(l, 0.50),
+			(unsigned long long)lat_pct(l, 0.99),
+			(unsigned long long)lat_pct(l, 0.999));
+	} else
+		printf(",,\n");
+
+	fflush(stdout);
+}
+
+/*
+** bench_count() -- pick a message count that moves about 'bytes' bytes
+** of payload, clamped to [lo, hi].
+*/
+static inline size_t bench_count(size_t size, size_t bytes, size_t lo,
+	size_t hi)
+{
+	size_t n = bytes / size;
+
+	if (n < lo) n = lo;
+	if (n > hi) n = hi;
+
+	return n;
+}
+
+/*
+** readn()/writen() -- keep calling read()/write() until all n bytes are
+** moved.  Stream transports happily return short counts for big
+** messages.  Returns n on success, 0 on EOF, -1 on error.
+*/
+static inline ssize_t readn(int fd, void *buf, size_t n)
+{
+	size_t got = 0;
+
+	while (got < n) {
+		ssize_t r = read(fd, (char *)buf + got, n - got);
+
+		if (r == -1 && errno == EINTR) continue;
+		if (r <= 0) return r;
+		got += r;
+	}
+
+	return got;
+}
+
+static inline ssize_t writen(int fd, const void *buf, size_t n)
+{
+	size_t put = 0;
+
+	while (put < n) {
+		ssize_t r = write(fd, (const char *)buf + put, n - put);
+
+		if (r == -1 && errno == EINTR) continue;
+		if (r == -1) return -1;
+		put += r;
+	}
+
+	return put;
+}
+
+/*
+** bench_make_file() -- a scratch file of mib MiB of text, lines of
+** varying length like a log, synced so its pages are clean and
+** posix_fadvise() can drop them.  Exits on error.
+*/
+static inline void bench_make_file(const char *path, size_t mib)
+{
+	char buf[65536];
+	size_t i;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		perror(path);
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof buf; i++)
+		buf[i] = (i * 2654435761u) % 97 == 0 ? '\n' : 'a' + i % 26;
+
+	for (i = 0; i < mib * 16; i++)
+		if (writen(fd, buf, sizeof buf) == -1) {
+			perror("write");
+			exit(1);
+		}
+
+	fsync(fd);
+	close(fd);
+}
+
+/*
+** raise_nofile() -- lift the open file limit as high as we're allowed,
+** for benchmarks that hold a descriptor per client
+*/
+static inline void raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/*
+** read_proc_long() -- read a single number out of a /proc file, or
+** dflt if we can't
+*/
+static inline long read_proc_long(const char *path, long dflt)
+{
+	FILE *fp;
+	long v;
+
+	if ((fp = fopen(path, "r")) == NULL) return dflt;
+	if (fscanf(fp, "%ld", &v) != 1) v = dflt;
+	fclose(fp);
+
+	return v;
+}
+
+#endif
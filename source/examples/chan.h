@@ -0,0 +1,171 @@
+/*
+** chan.h -- a bounded channel of fixed-size records between processes,
+** guarded by a pthread mutex and two condition variables that live in
+** the shared mapping with it
+**
+** Mutexes and condition variables normally only work between threads,
+** but set PTHREAD_PROCESS_SHARED on them, put them in memory that's
+** MAP_SHARED (as in mmap_anon.c), and they work between processes too.
+** Neither one costs a system call unless somebody has to sleep: locking
+** a free mutex is an atomic instruction, and chan_send()/chan_recv()
+** only signal a condition variable when a waiter is counted on it.
+**
+** Any number of processes may send and receive.
+*/
+
+#ifndef CHAN_H
+#define CHAN_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct chan {
+	pthread_mutex_t lock;
+	pthread_cond_t notempty, notfull;
+
+	/* all guarded by lock */
+	uint32_t head, tail, count;
+	uint32_t recv_waiting, send_waiting;
+
+	/* read-only after chan_init() */
+	uint32_t cap;
+	uint32_t recsize;
+	uint32_t stride;
+
+	_Alignas(8) unsigned char data[];
+};
+
+static inline uint32_t chan_stride(uint32_t recsize)
+{
+	return (recsize + 7) & ~7u;  /* keep records 8-byte aligned */
+}
+
+/*
+** chan_bytes() -- how much memory a channel of cap records needs
+*/
+static inline size_t chan_bytes(uint32_t cap, uint32_t recsize)
+{
+	return sizeof(struct chan) + (size_t)cap * chan_stride(recsize);
+}
+
+/*
+** chan_init() -- set up a channel in shared memory of at least
+** chan_bytes() bytes.  Returns -1 with errno set on error.
+*/
+static inline int chan_init(struct chan *c, uint32_t cap, uint32_t recsize)
+{
+	pthread_mutexattr_t ma;
+	pthread_condattr_t ca;
+
+	if (cap == 0 || recsize == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	errno = pthread_mutex_init(&c->lock, &ma);
+	pthread_mutexattr_destroy(&ma);
+	if (errno != 0) return -1;
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+	if ((errno = pthread_cond_init(&c->notempty, &ca)) != 0 ||
+	    (errno = pthread_cond_init(&c->notfull, &ca)) != 0) {
+		pthread_condattr_destroy(&ca);
+		return -1;
+	}
+	pthread_condattr_destroy(&ca);
+
+	c->head = c->tail = c->count = 0;
+	c->recv_waiting = c->send_waiting = 0;
+	c->cap = cap;
+	c->recsize = recsize;
+	c->stride = chan_stride(recsize);
+
+	return 0;
+}
+
+/*
+** chan_create() -- map an anonymous shared region and build a channel
+** in it.  The channel is shared with children forked after this call.
+** Returns NULL on error.
+*/
+static inline struct chan *chan_create(uint32_t cap, uint32_t recsize)
+{
+	struct chan *c;
+
+	c = mmap(NULL, chan_bytes(cap, recsize), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED) return NULL;
+
+	if (chan_init(c, cap, recsize) == -1) {
+		int e = errno;
+		munmap(c, chan_bytes(cap, recsize));
+		errno = e;
+		return NULL;
+	}
+
+	return c;
+}
+
+static inline void chan_destroy(struct chan *c)
+{
+	pthread_cond_destroy(&c->notempty);
+	pthread_cond_destroy(&c->notfull);
+	pthread_mutex_destroy(&c->lock);
+	munmap(c, chan_bytes(c->cap, c->recsize));
+}
+
+/*
+** chan_send() -- copy one record in, waiting while the channel is full
+*/
+static inline void chan_send(struct chan *c, const void *rec)
+{
+	pthread_mutex_lock(&c->lock);
+
+	while (c->count == c->cap) {
+		c->send_waiting++;
+		pthread_cond_wait(&c->notfull, &c->lock);
+		c->send_waiting--;
+	}
+
+	memcpy(c->data + (size_t)c->head * c->stride, rec, c->recsize);
+	if (++c->head == c->cap) c->head = 0;
+	c->count++;
+
+	if (c->recv_waiting) pthread_cond_signal(&c->notempty);
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+** chan_recv() -- copy one record out, waiting while the channel is empty
+*/
+static inline void chan_recv(struct chan *c, void *rec)
+{
+	pthread_mutex_lock(&c->lock);
+
+	while (c->count == 0) {
+		c->recv_waiting++;
+		pthread_cond_wait(&c->notempty, &c->lock);
+		c->recv_waiting--;
+	}
+
+	memcpy(rec, c->data + (size_t)c->tail * c->stride, c->recsize);
+	if (++c->tail == c->cap) c->tail = 0;
+	c->count--;
+
+	if (c->send_waiting) pthread_cond_signal(&c->notfull);
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+#endif
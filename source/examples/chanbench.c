@@ -0,0 +1,346 @@
+/*
+** chanbench.c -- a forked producer and consumer passing records through
+** shared memory, handed off three ways:
+**
+**   pthread     chan.h: a process-shared pthread mutex and condition
+**               variables
+**   sysv_sem    semdemo.c's semop(), with a set of two semaphores
+**               counting empty and full slots
+**   futex_ring  ring.h's lock-free ring, sleeping on a futex only when
+**               it's full or empty
+**
+** Each one streams -n records from the parent to the child, for
+** throughput, and then bounces -p records back and forth over a pair of
+** them, timing every round trip.  Prints CSV (see bench.h).
+**
+** usage: chanbench [-n records] [-p round_trips] [-s size] [-c capacity]
+*/
+
+#ifndef __linux__
+#warning "chanbench needs Linux futexes."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/mman.h>
+
+#include "bench.h"
+#include "chan.h"
+#include "ring.h"
+
+#define DEFAULT_RECS 1000000
+#define DEFAULT_TRIPS 100000
+#define DEFAULT_CAP 1024
+
+enum { PTHREAD, SYSV_SEM, FUTEX_RING, NMECHS };
+
+static const char *mech_names[] = { "pthread", "sysv_sem", "futex_ring" };
+
+/* semaphore numbers in a semq's set */
+enum { EMPTY, FULL };
+
+/*
+** semq -- one producer, one consumer, and a semaphore for each side to
+** wait on.  The semop() is a full barrier, so head and tail need no
+** more care than that: each is only touched by one side.
+*/
+struct semq {
+	int semid;
+	uint32_t cap, recsize, stride;
+	uint32_t head, tail;
+	_Alignas(8) unsigned char data[];
+};
+
+/* one direction of traffic */
+struct link {
+	int mech;
+	size_t bytes;
+	union {
+		struct chan *c;
+		struct semq *s;
+		struct ring *r;
+		void *p;
+	} q;
+};
+
+static struct semq *semq_create(uint32_t cap, uint32_t recsize)
+{
+	union { unsigned short *array; } arg;  /* union semun, cut down */
+	unsigned short vals[2];
+	struct semq *s;
+
+	s = mmap(NULL, sizeof *s + (size_t)cap * chan_stride(recsize),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED) return NULL;
+
+	s->cap = cap;
+	s->recsize = recsize;
+	s->stride = chan_stride(recsize);
+	s->head = s->tail = 0;
+
+	vals[EMPTY] = cap;
+	vals[FULL] = 0;
+	arg.array = vals;
+
+	if ((s->semid = semget(IPC_PRIVATE, 2, 0600)) == -1 ||
+	    semctl(s->semid, 0, SETALL, arg) == -1) {
+		int e = errno;
+		if (s->semid != -1) semctl(s->semid, 0, IPC_RMID);
+		munmap(s, sizeof *s + (size_t)cap * s->stride);
+		errno = e;
+		return NULL;
+	}
+
+	return s;
+}
+
+static void semq_op(struct semq *s, unsigned short num, short op)
+{
+	struct sembuf sb = { num, op, 0 };
+
+	while (semop(s->semid, &sb, 1) == -1)
+		if (errno != EINTR) {
+			perror("semop");
+			exit(1);
+		}
+}
+
+static void semq_send(struct semq *s, const void *rec)
+{
+	semq_op(s, EMPTY, -1);
+	memcpy(s->data + (size_t)s->head * s->stride, rec, s->recsize);
+	if (++s->head == s->cap) s->head = 0;
+	semq_op(s, FULL, 1);
+}
+
+static void semq_recv(struct semq *s, void *rec)
+{
+	semq_op(s, FULL, -1);
+	memcpy(rec, s->data + (size_t)s->tail * s->stride, s->recsize);
+	if (++s->tail == s->cap) s->tail = 0;
+	semq_op(s, EMPTY, 1);
+}
+
+static void link_open(struct link *l, int mech, uint32_t cap, uint32_t size)
+{
+	l->mech = mech;
+
+	switch (mech) {
+		case PTHREAD:
+			l->q.c = chan_create(cap, size);
+			l->bytes = chan_bytes(cap, size);
+			break;
+
+		case SYSV_SEM:
+			l->q.s = semq_create(cap, size);
+			l->bytes = sizeof *l->q.s + (size_t)cap * chan_stride(size);
+			break;
+
+		case FUTEX_RING:
+			l->q.r = ring_create(cap, size);
+			l->bytes = ring_bytes(cap, size);
+			break;
+	}
+
+	if (l->q.p == NULL) {
+		perror(mech_names[mech]);
+		exit(1);
+	}
+}
+
+static void link_close(struct link *l)
+{
+	switch (l->mech) {
+		case PTHREAD:
+			chan_destroy(l->q.c);
+			break;
+
+		case SYSV_SEM:
+			semctl(l->q.s->semid, 0, IPC_RMID);
+			munmap(l->q.s, l->bytes);
+			break;
+
+		case FUTEX_RING:
+			ring_destroy(l->q.r);
+			break;
+	}
+}
+
+static void link_send(struct link *l, const void *rec)
+{
+	switch (l->mech) {
+		case PTHREAD: chan_send(l->q.c, rec); break;
+		case SYSV_SEM: semq_send(l->q.s, rec); break;
+		case FUTEX_RING: ring_push_wait(l->q.r, rec); break;
+	}
+}
+
+static void link_recv(struct link *l, void *rec)
+{
+	switch (l->mech) {
+		case PTHREAD: chan_recv(l->q.c, rec); break;
+		case SYSV_SEM: semq_recv(l->q.s, rec); break;
+		case FUTEX_RING: ring_pop_wait(l->q.r, rec); break;
+	}
+}
+
+static void reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "chanbench: child failed\n");
+		exit(1);
+	}
+}
+
+/*
+** stream() -- send n records to a child as fast as it'll take them.
+** Each one carries its number, and the child checks they come in order.
+*/
+static void stream(int mech, size_t n, uint32_t size, uint32_t cap)
+{
+	unsigned char buf[size];
+	uint64_t elapsed;
+	struct link l;
+	char name[64];
+	size_t i;
+	pid_t pid;
+
+	link_open(&l, mech, cap, size);
+	memset(buf, 'x', size);
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			for (i = 0; i < n; i++) {
+				link_recv(&l, buf);
+				if (memcmp(buf, &i, sizeof i) != 0) {
+					fprintf(stderr, "chanbench: record %zu out of order\n",
+						i);
+					_exit(1);
+				}
+			}
+			_exit(0);
+	}
+
+	elapsed = now_ns();
+	for (i = 0; i < n; i++) {
+		memcpy(buf, &i, sizeof i);
+		link_send(&l, buf);
+	}
+	reap(pid);
+	elapsed = now_ns() - elapsed;
+
+	snprintf(name, sizeof name, "%s_stream", mech_names[mech]);
+	bench_csv_row(name, size, n, elapsed, NULL);
+	fflush(stdout);
+
+	link_close(&l);
+}
+
+/*
+** pingpong() -- send a record, wait for the child to send it back, and
+** time the round trip, n times
+*/
+static void pingpong(int mech, size_t n, uint32_t size, uint32_t cap)
+{
+	unsigned char buf[size];
+	struct link ping, pong;
+	uint64_t elapsed;
+	struct lat lat;
+	char name[64];
+	size_t i;
+	pid_t pid;
+
+	link_open(&ping, mech, cap, size);
+	link_open(&pong, mech, cap, size);
+	memset(buf, 'x', size);
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			for (i = 0; i < n; i++) {
+				link_recv(&ping, buf);
+				link_send(&pong, buf);
+			}
+			_exit(0);
+	}
+
+	lat_init(&lat, n);
+
+	elapsed = now_ns();
+	for (i = 0; i < n; i++) {
+		uint64_t t0 = now_ns();
+
+		link_send(&ping, buf);
+		link_recv(&pong, buf);
+		lat_add(&lat, now_ns() - t0);
+	}
+	elapsed = now_ns() - elapsed;
+	reap(pid);
+
+	snprintf(name, sizeof name, "%s_pingpong", mech_names[mech]);
+	bench_csv_row(name, size, n, elapsed, &lat);
+	fflush(stdout);
+
+	lat_free(&lat);
+	link_close(&ping);
+	link_close(&pong);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t nrecs = DEFAULT_RECS, trips = DEFAULT_TRIPS;
+	uint32_t size = 64, cap = DEFAULT_CAP;
+	int opt, mech;
+
+	while ((opt = getopt(argc, argv, "n:p:s:c:")) != -1) {
+		switch (opt) {
+			case 'n': nrecs = strtoul(optarg, NULL, 0); break;
+			case 'p': trips = strtoul(optarg, NULL, 0); break;
+			case 's': size = strtoul(optarg, NULL, 0); break;
+			case 'c': cap = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: chanbench [-n records] "
+					"[-p round_trips] [-s size] [-c capacity]\n");
+				exit(1);
+		}
+	}
+
+	if (size < sizeof(size_t)) size = sizeof(size_t);
+
+	/* ring.h needs a power of two; SysV semaphores top out at 32767 */
+	if (cap == 0 || (cap & (cap - 1)) != 0 || cap > 16384) {
+		fprintf(stderr, "chanbench: capacity must be a power of two up to "
+			"16384\n");
+		exit(1);
+	}
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (mech = PTHREAD; mech < NMECHS; mech++)
+		stream(mech, nrecs, size, cap);
+	for (mech = PTHREAD; mech < NMECHS; mech++)
+		pingpong(mech, trips, size, cap);
+
+	return 0;
+}
+
+#endif
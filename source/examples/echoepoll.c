@@ -0,0 +1,316 @@
+/*
+** echoepoll.c -- an echo server for echoc.c that serves any number of
+** clients at once from an edge-triggered epoll loop
+**
+** echos.c serves one client to completion before it calls accept()
+** again.  Here every socket is non-blocking and one epoll loop drives
+** them all.  With -t, there's one such loop per thread, each pinned to
+** its own CPU, so the service scales with cores.  Load it up with
+** echoload.c (or "make echobench").
+**
+** usage: echoepoll [-t threads]    (-t 0 means one per CPU)
+**
+** On ^C it prints how many connections each thread took, how many it
+** still has open, and how many times it woke up for the listener and
+** found nothing to accept.
+*/
+
+#ifndef __linux__
+#warning "echoepoll needs Linux epoll."
+int main(void) {}
+#else
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "bench.h"
+
+#define SOCK_PATH "echo_socket"
+#define BUF_SIZE 4096
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 1  /* connections to take per listener wakeup */
+
+struct loop;
+
+/*
+** One of these per client.  When the client sends faster than it
+** reads, whatever we couldn't send back yet waits in buf.
+*/
+struct conn {
+	int fd;
+	struct loop *loop;  /* the thread that serves us */
+	size_t off, len;   /* unsent bytes are buf[off..len) */
+	char buf[BUF_SIZE];
+};
+
+void conn_close(struct conn *c);
+
+/*
+** conn_flush() -- send what's pending.  Returns 0 when it's all gone,
+** 1 if the socket is full (we'll get EPOLLOUT later), -1 on error.
+*/
+int conn_flush(struct conn *c)
+{
+	while (c->off < c->len) {
+		ssize_t n = send(c->fd, c->buf + c->off, c->len - c->off,
+			MSG_NOSIGNAL);
+
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		c->off += n;
+	}
+
+	c->off = c->len = 0;
+
+	return 0;
+}
+
+/*
+** conn_ready() -- edge-triggered, so we have to keep going until the
+** kernel says EAGAIN or we'd never hear about this data again.  The
+** exception is when we can't send: then we stop reading and wait for
+** the EPOLLOUT edge, which lands back here.
+*/
+void conn_ready(struct conn *c)
+{
+	for (;;) {
+		ssize_t n;
+		int r;
+
+		if ((r = conn_flush(c)) == 1) return;
+		if (r == -1) break;
+
+		if ((n = recv(c->fd, c->buf, sizeof c->buf, 0)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+			if (errno == EINTR) continue;
+			perror("recv");
+			break;
+		}
+		if (n == 0) break;  /* client hung up */
+
+		c->len = n;
+	}
+
+	conn_close(c);
+}
+
+/*
+** Each thread runs its own event loop.  They all watch the same
+** listening socket, but with EPOLLEXCLUSIVE the kernel wakes just one
+** of them per new connection instead of the whole herd.  Whoever
+** accepts a connection serves it for life, so a loop only takes
+** ACCEPT_BATCH per wakeup.  The listener is level-triggered: if more
+** are waiting, the next wakeup goes to whichever loop is idle, and a
+** burst of connections gets spread around instead of landing on one.
+*/
+struct loop {
+	pthread_t tid;
+	int id, cpu;
+	int lsock;
+	_Atomic unsigned long wakeups;  /* listener events */
+	_Atomic unsigned long accepts;  /* connections accepted */
+	_Atomic unsigned long open;     /* ...and not closed yet */
+	_Atomic unsigned long empty;    /* listener events with nothing to take */
+};
+
+void conn_close(struct conn *c)
+{
+	atomic_fetch_sub_explicit(&c->loop->open, 1, memory_order_relaxed);
+	close(c->fd);  /* also takes it out of the epoll set */
+	free(c);
+}
+
+/*
+** accept_some() -- take up to ACCEPT_BATCH pending connections and
+** leave the rest for the next wakeup
+*/
+void accept_some(struct loop *l, int epfd)
+{
+	unsigned long taken = 0;
+
+	atomic_fetch_add_explicit(&l->wakeups, 1, memory_order_relaxed);
+
+	while (taken < ACCEPT_BATCH) {
+		struct epoll_event ev;
+		struct conn *c;
+		int fd;
+
+		if ((fd = accept4(l->lsock, NULL, NULL, SOCK_NONBLOCK)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+			break;
+		}
+
+		if ((c = malloc(sizeof *c)) == NULL) {
+			perror("malloc");
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->loop = l;
+		c->off = c->len = 0;
+		taken++;
+		atomic_fetch_add_explicit(&l->open, 1, memory_order_relaxed);
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl");
+			conn_close(c);
+		}
+	}
+
+	atomic_fetch_add_explicit(&l->accepts, taken, memory_order_relaxed);
+	if (taken == 0)
+		atomic_fetch_add_explicit(&l->empty, 1, memory_order_relaxed);
+}
+
+/*
+** serve() -- one thread's event loop
+*/
+void *serve(void *arg)
+{
+	struct loop *l = arg;
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLEXCLUSIVE,  /* level-triggered */
+		.data.ptr = NULL,  /* NULL means the listening socket */
+	};
+	struct epoll_event events[MAX_EVENTS];
+	cpu_set_t cpus;
+	int epfd, i, n;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(l->cpu, &cpus);
+	if ((errno = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus)) != 0)
+		perror("pthread_setaffinity_np");
+
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, l->lsock, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+
+	for(;;) {
+		if ((n = epoll_wait(epfd, events, MAX_EVENTS, -1)) == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL)
+				accept_some(l, epfd);
+			else
+				conn_ready(events[i].data.ptr);
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int s, len, opt, i, sig, nthreads = 1;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	struct loop *loops;
+	sigset_t stop;
+	struct sockaddr_un local = {
+		.sun_family = AF_UNIX,
+	};
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+			case 't': nthreads = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: echoepoll [-t threads]\n");
+				exit(1);
+		}
+	}
+
+	if (ncpu < 1) ncpu = 1;
+	if (nthreads <= 0) nthreads = ncpu;  /* -t 0: one per CPU */
+
+	raise_nofile();
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+		perror("socket");
+		exit(1);
+	}
+
+	strcpy(local.sun_path, SOCK_PATH);
+	unlink(local.sun_path);
+	len = strlen(local.sun_path) + sizeof(local.sun_family);
+	if (bind(s, (struct sockaddr *)&local, len) == -1) {
+		perror("bind");
+		exit(1);
+	}
+
+	if (listen(s, SOMAXCONN) == -1) {
+		perror("listen");
+		exit(1);
+	}
+
+	/*
+	** The loops never return, so the main thread just waits for ^C or
+	** SIGTERM and reports how evenly the work got spread.  Block the
+	** signals first so the threads inherit the mask and only we get
+	** them.
+	*/
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+	if ((loops = calloc(nthreads, sizeof *loops)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		loops[i].id = i;
+		loops[i].cpu = i % ncpu;
+		loops[i].lsock = s;
+		if ((errno = pthread_create(&loops[i].tid, NULL, serve, &loops[i])) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	printf("Waiting for connections on %d thread%s...\n", nthreads,
+		nthreads == 1 ? "" : "s");
+	fflush(stdout);
+
+	sigwait(&stop, &sig);
+
+	for (i = 0; i < nthreads; i++)
+		fprintf(stderr, "thread %d (cpu %d): %lu accepted, %lu open, %lu "
+			"listener wakeups, %lu empty\n", i, loops[i].cpu,
+			atomic_load(&loops[i].accepts), atomic_load(&loops[i].open),
+			atomic_load(&loops[i].wakeups), atomic_load(&loops[i].empty));
+
+	unlink(SOCK_PATH);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,384 @@
+/*
+** echoload.c -- a load generator for the echo servers: opens many
+** echoc.c-style connections at once and keeps a request in flight on
+** each of them
+**
+** Prints CSV (see bench.h): one row for connection setup rate and one
+** for request/response round trips, with latency percentiles.
+**
+** usage: echoload [-s sockpath] [-c conns] [-r requests] [-m msgsize]
+**                 [-j procs] [-u] [-l label] [-H]
+**
+** -u drives the requests through io_uring (see uring.h) instead of
+** epoll: each request is a send linked to a receive, and one
+** io_uring_enter() submits a whole batch of them.  -j splits the
+** connections across that many generator processes, so the load
+** generator doesn't become the bottleneck when the server has more
+** than one core.  -H leaves off the CSV header.
+**
+** echos.c only talks to one client at a time, so use -c 1 with it.
+*/
+
+#ifndef __linux__
+#warning "echoload needs Linux epoll."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "bench.h"
+#include "uring.h"
+
+#define SOCK_PATH "echo_socket"
+#define DEFAULT_CONNS 1000
+#define DEFAULT_REQUESTS 100
+#define DEFAULT_MSGSIZE 64
+#define MAX_MSGSIZE 4096
+#define MAX_PROCS 256
+#define MAX_EVENTS 256
+#define URING_ENTRIES 4096
+
+struct lconn {
+	int fd;
+	size_t got;      /* bytes of the current echo received */
+	size_t done;     /* requests completed */
+	uint64_t sent;   /* when the current request went out */
+};
+
+/*
+** The generator processes drop their results in here, an anonymous
+** shared mapping as in mmap_anon.c.  Each one owns a slice of lat[].
+*/
+struct results {
+	uint64_t connect_ns[MAX_PROCS];
+	uint64_t start[MAX_PROCS], end[MAX_PROCS];  /* request phase */
+	uint64_t lat[];
+};
+
+static char msg[MAX_MSGSIZE];
+static int use_uring;
+
+static void send_request(struct lconn *c, size_t msgsize)
+{
+	c->got = 0;
+	c->sent = now_ns();
+
+	/* one small message at a time, so a blocking send won't stall */
+	if (writen(c->fd, msg, msgsize) == -1) {
+		perror("send");
+		exit(1);
+	}
+}
+
+/*
+** run_epoll() -- send a request on each connection, then answer each
+** echo that comes back with the next request
+*/
+static void run_epoll(struct lconn *conns, size_t nconns, size_t nreq,
+	size_t msgsize, uint64_t *lat)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	char buf[MAX_MSGSIZE];
+	size_t i, active, nlat = 0;
+	int epfd;
+
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	for (i = 0; i < nconns; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &conns[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+		send_request(&conns[i], msgsize);
+	}
+
+	for (active = nconns; active > 0; ) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		while (n-- > 0) {
+			struct lconn *c = events[n].data.ptr;
+			ssize_t r = recv(c->fd, buf, msgsize - c->got, MSG_DONTWAIT);
+
+			if (r == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+				perror("recv");
+				exit(1);
+			}
+			if (r == 0) {
+				fprintf(stderr, "echoload: server closed connection\n");
+				exit(1);
+			}
+
+			if ((c->got += r) < msgsize) continue;
+
+			lat[nlat++] = now_ns() - c->sent;
+
+			if (++c->done < nreq)
+				send_request(c, msgsize);
+			else {
+				close(c->fd);
+				active--;
+			}
+		}
+	}
+
+	close(epfd);
+}
+
+/*
+** uring_request() -- queue one request: a send, linked to a receive
+** that waits for the whole echo.  Successful sends don't even post a
+** completion.
+*/
+static void uring_request(struct uring *u, struct lconn *c, size_t i,
+	char *rbuf, size_t msgsize)
+{
+	struct io_uring_sqe *sqe;
+
+	uring_sqe_room(u, 2);  /* the pair goes to the kernel together */
+
+	sqe = uring_sqe(u);
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t)msg;
+	sqe->len = msgsize;
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = i << 1;
+
+	sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t)(rbuf + i * msgsize);
+	sqe->len = msgsize;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->user_data = i << 1 | 1;
+
+	c->sent = now_ns();
+}
+
+/*
+** run_uring() -- the same closed loop as run_epoll(), on io_uring
+*/
+static void run_uring(struct lconn *conns, size_t nconns, size_t nreq,
+	size_t msgsize, uint64_t *lat)
+{
+	struct io_uring_cqe *cqe;
+	struct uring u;
+	size_t i, active, nlat = 0;
+	char *rbuf;
+
+	if (uring_init(&u, URING_ENTRIES) == -1) {
+		perror("io_uring_setup");
+		exit(1);
+	}
+	if ((rbuf = malloc(nconns * msgsize)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < nconns; i++)
+		uring_request(&u, &conns[i], i, rbuf, msgsize);
+
+	for (active = nconns; active > 0; ) {
+		if (uring_enter(&u, 1) == -1 && errno != EINTR) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+
+		while ((cqe = uring_cqe(&u)) != NULL) {
+			struct lconn *c = &conns[cqe->user_data >> 1];
+			int res = cqe->res, is_recv = cqe->user_data & 1;
+
+			uring_cqe_seen(&u);
+
+			if (!is_recv || res != (int)msgsize) {
+				if (res < 0) errno = -res;
+				else errno = EPIPE;  /* short echo: server hung up */
+				perror(is_recv ? "recv" : "send");
+				exit(1);
+			}
+
+			lat[nlat++] = now_ns() - c->sent;
+
+			if (++c->done < nreq)
+				uring_request(&u, c, c - conns, rbuf, msgsize);
+			else {
+				close(c->fd);
+				active--;
+			}
+		}
+	}
+
+	free(rbuf);
+	close(u.fd);
+}
+
+/*
+** generate() -- one generator process: connect nconns clients, then run
+** nreq requests on each.  Latencies go in lat[], in completion order.
+*/
+static void generate(const struct sockaddr_un *remote, size_t nconns,
+	size_t nreq, size_t msgsize, struct results *res, int id, uint64_t *lat)
+{
+	struct lconn *conns;
+	uint64_t t0;
+	size_t i;
+
+	if ((conns = calloc(nconns, sizeof *conns)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	/* phase 1: connect everybody */
+	t0 = now_ns();
+	for (i = 0; i < nconns; i++) {
+		if ((conns[i].fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			perror("socket");
+			exit(1);
+		}
+		if (connect(conns[i].fd, (struct sockaddr *)remote,
+		    sizeof *remote) == -1) {
+			perror("connect");
+			exit(1);
+		}
+	}
+	res->connect_ns[id] = now_ns() - t0;
+
+	/* phase 2: closed-loop requests on every connection at once */
+	res->start[id] = now_ns();
+	if (use_uring)
+		run_uring(conns, nconns, nreq, msgsize, lat);
+	else
+		run_epoll(conns, nconns, nreq, msgsize, lat);
+	res->end[id] = now_ns();
+
+	free(conns);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un remote = { .sun_family = AF_UNIX };
+	const char *path = SOCK_PATH, *label = "echo";
+	size_t nconns = DEFAULT_CONNS, nreq = DEFAULT_REQUESTS;
+	size_t msgsize = DEFAULT_MSGSIZE, rbytes, first, i;
+	int opt, nprocs = 1, header = 1, status, failed = 0;
+	uint64_t start = UINT64_MAX, end = 0, connect_ns = 0;
+	struct results *res;
+	struct lat lat;
+	char name[64];
+
+	while ((opt = getopt(argc, argv, "s:c:r:m:j:ul:H")) != -1) {
+		switch (opt) {
+			case 's': path = optarg; break;
+			case 'c': nconns = strtoul(optarg, NULL, 0); break;
+			case 'r': nreq = strtoul(optarg, NULL, 0); break;
+			case 'm': msgsize = strtoul(optarg, NULL, 0); break;
+			case 'j': nprocs = atoi(optarg); break;
+			case 'u': use_uring = 1; break;
+			case 'l': label = optarg; break;
+			case 'H': header = 0; break;
+			default:
+				fprintf(stderr, "usage: echoload [-s sockpath] [-c conns] "
+					"[-r requests] [-m msgsize] [-j procs] [-u] "
+					"[-l label] [-H]\n");
+				exit(1);
+		}
+	}
+
+	if (nconns == 0 || nreq == 0 || msgsize == 0 || msgsize > MAX_MSGSIZE ||
+	    nprocs < 1 || nprocs > MAX_PROCS || (size_t)nprocs > nconns ||
+	    strlen(path) >= sizeof remote.sun_path) {
+		fprintf(stderr, "echoload: bad arguments\n");
+		exit(1);
+	}
+
+	raise_nofile();
+	memset(msg, 'e', sizeof msg);
+	strcpy(remote.sun_path, path);
+
+	rbytes = sizeof *res + nconns * nreq * sizeof res->lat[0];
+	res = mmap(NULL, rbytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+		-1, 0);
+	if (res == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	fflush(stdout);
+
+	/* hand out the connections as evenly as we can */
+	for (i = 0, first = 0; i < (size_t)nprocs; i++) {
+		size_t n = nconns / nprocs + (i < nconns % nprocs);
+
+		switch (fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0:
+				generate(&remote, n, nreq, msgsize, res, i,
+					res->lat + first * nreq);
+				_exit(0);
+		}
+		first += n;
+	}
+
+	while (wait(&status) != -1)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+
+	if (failed) {
+		fprintf(stderr, "echoload: a generator failed\n");
+		exit(1);
+	}
+
+	/*
+	** The generators ran in parallel: the slowest sets the connection
+	** rate, and the request phase runs from the first start to the
+	** last finish.
+	*/
+	for (i = 0; i < (size_t)nprocs; i++) {
+		if (res->connect_ns[i] > connect_ns) connect_ns = res->connect_ns[i];
+		if (res->start[i] < start) start = res->start[i];
+		if (res->end[i] > end) end = res->end[i];
+	}
+
+	lat.ns = res->lat;
+	lat.n = lat.cap = nconns * nreq;
+
+	if (header) bench_csv_header();
+
+	snprintf(name, sizeof name, "%s_connect", label);
+	bench_csv_row(name, 0, nconns, connect_ns, NULL);
+
+	snprintf(name, sizeof name, "%s_rr_%zuc", label, nconns);
+	bench_csv_row(name, msgsize, nconns * nreq, end - start, &lat);
+
+	munmap(res, rbytes);
+
+	return 0;
+}
+
+#endif
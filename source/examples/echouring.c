@@ -0,0 +1,327 @@
+/*
+** echouring.c -- an echo server for echoc.c built on io_uring
+**
+** Where echos.c makes a recv() and a send() system call for every
+** message, here the kernel does the work in the background:
+**
+**   - one multishot accept keeps taking new connections
+**   - one multishot receive per connection keeps filling buffers from a
+**     registered buffer ring, without being asked again
+**   - the echoes go out as chains of linked sends, so they stay in order
+**
+** and a single io_uring_enter() per loop submits everything and waits.
+** Load it up with echoload.c (try "echoload -u" for an io_uring client).
+**
+** On ^C it prints how many messages it echoed per system call.
+*/
+
+#ifndef __linux__
+#warning "echouring needs Linux io_uring."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bench.h"
+#include "uring.h"
+
+#define SOCK_PATH "echo_socket"
+#define ENTRIES 4096
+#define NBUFS 4096        /* power of two */
+#define BUF_SIZE 4096
+#define BGID 0
+
+/* what a completion was for, tucked in the low bits of user_data */
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND };
+#define OP_MASK 7
+
+/*
+** One of these per client.  q[] holds the buffer ids we owe the client,
+** in order: [qhead, qsend) are in flight as a linked chain of sends and
+** [qsend, qtail) are waiting for that chain to finish.
+*/
+struct conn {
+	int fd;
+	int recv_armed;     /* multishot receive still running */
+	int closing;
+	int starved;        /* receive stopped for lack of buffers */
+	struct conn *next_starved;
+	unsigned qhead, qsend, qtail;
+	unsigned short q[NBUFS];
+};
+
+static struct uring ring;
+static struct uring_bufs bufs;
+static unsigned buflen[NBUFS];
+static struct conn *starved;
+static int lsock, returned;
+static unsigned long echoed;
+static volatile sig_atomic_t done;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static void arm_accept(void)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = lsock;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = OP_ACCEPT;
+}
+
+static void arm_recv(struct conn *c)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (uintptr_t)c | OP_RECV;
+	c->recv_armed = 1;
+}
+
+static void give_back(unsigned bid)
+{
+	uring_buf_return(&bufs, bid);
+	returned = 1;
+}
+
+/*
+** kick_sends() -- if no chain is in flight, send everything waiting as
+** one chain.  IOSQE_IO_LINK makes each send wait for the one before it,
+** so the bytes go back out in the order they came in.  A chain is
+** capped at what fits in the submission ring; the rest goes out as the
+** next chain when this one's done.
+*/
+static void kick_sends(struct conn *c)
+{
+	unsigned end;
+
+	if (c->closing || c->qhead != c->qsend) return;
+
+	end = c->qtail - c->qsend > ring.sq_entries ?
+		c->qsend + ring.sq_entries : c->qtail;
+	uring_sqe_room(&ring, end - c->qsend);
+
+	while (c->qsend != end) {
+		unsigned bid = c->q[c->qsend++ % NBUFS];
+		struct io_uring_sqe *sqe = uring_sqe(&ring);
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = c->fd;
+		sqe->addr = (uintptr_t)uring_buf(&bufs, bid);
+		sqe->len = buflen[bid];
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		sqe->user_data = (uintptr_t)c | OP_SEND;
+		if (c->qsend != end) sqe->flags = IOSQE_IO_LINK;
+	}
+}
+
+/*
+** start_close() -- stop taking data.  shutdown() ends the multishot
+** receive; the conn is freed once nothing refers to it any more.
+*/
+static void start_close(struct conn *c)
+{
+	if (c->closing) return;
+
+	c->closing = 1;
+	shutdown(c->fd, SHUT_RDWR);
+
+	while (c->qsend != c->qtail)  /* never sent; drop them */
+		give_back(c->q[--c->qtail % NBUFS]);
+}
+
+static void maybe_free(struct conn *c)
+{
+	if (c->closing && !c->recv_armed && !c->starved &&
+	    c->qhead == c->qsend) {
+		close(c->fd);
+		free(c);
+	}
+}
+
+static void on_accept(struct io_uring_cqe *cqe)
+{
+	struct conn *c;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) arm_accept();
+
+	if (cqe->res < 0) {
+		errno = -cqe->res;
+		perror("accept");
+		return;
+	}
+
+	if ((c = calloc(1, sizeof *c)) == NULL) {
+		perror("calloc");
+		close(cqe->res);
+		return;
+	}
+	c->fd = cqe->res;
+	arm_recv(c);
+}
+
+static void on_recv(struct conn *c, struct io_uring_cqe *cqe)
+{
+	if (!(cqe->flags & IORING_CQE_F_MORE)) c->recv_armed = 0;
+
+	if (cqe->res > 0) {
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (c->closing) {
+			give_back(bid);
+		} else {
+			buflen[bid] = cqe->res;
+			c->q[c->qtail++ % NBUFS] = bid;
+			kick_sends(c);
+		}
+
+		/* a multishot receive can end on its own; start another */
+		if (!c->recv_armed && !c->closing) arm_recv(c);
+
+	} else if (cqe->res == -ENOBUFS && !c->closing) {
+		/* out of buffers: wait for some to come back, then rearm */
+		if (!c->recv_armed && !c->starved) {
+			c->starved = 1;
+			c->next_starved = starved;
+			starved = c;
+		}
+	} else {
+		start_close(c);  /* EOF or error */
+	}
+
+	maybe_free(c);
+}
+
+static void on_send(struct conn *c, struct io_uring_cqe *cqe)
+{
+	unsigned bid = c->q[c->qhead++ % NBUFS];
+
+	/* a failed link cancels the rest of the chain with -ECANCELED */
+	if (cqe->res != (int)buflen[bid])
+		start_close(c);
+	else
+		echoed++;
+
+	give_back(bid);
+
+	if (c->qhead == c->qsend) kick_sends(c);
+	maybe_free(c);
+}
+
+/*
+** rearm_starved() -- buffers came back, so get every starved
+** connection receiving again
+*/
+static void rearm_starved(void)
+{
+	while (starved != NULL) {
+		struct conn *c = starved;
+
+		starved = c->next_starved;
+		c->starved = 0;
+		if (!c->closing) arm_recv(c);
+		maybe_free(c);
+	}
+}
+
+int main(void)
+{
+	struct sockaddr_un local = { .sun_family = AF_UNIX };
+	struct sigaction sa;
+	int len;
+
+	raise_nofile();
+
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("socket");
+		exit(1);
+	}
+
+	strcpy(local.sun_path, SOCK_PATH);
+	unlink(local.sun_path);
+	len = strlen(local.sun_path) + sizeof(local.sun_family);
+	if (bind(lsock, (struct sockaddr *)&local, len) == -1) {
+		perror("bind");
+		exit(1);
+	}
+
+	if (listen(lsock, SOMAXCONN) == -1) {
+		perror("listen");
+		exit(1);
+	}
+
+	if (uring_init(&ring, ENTRIES) == -1) {
+		perror("io_uring_setup");
+		exit(1);
+	}
+
+	if (uring_bufs_init(&ring, &bufs, NBUFS, BUF_SIZE, BGID) == -1) {
+		perror("io_uring_register");
+		exit(1);
+	}
+
+	/* no SA_RESTART: we want io_uring_enter() to come back with EINTR */
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	arm_accept();
+
+	printf("Waiting for connections...\n");
+	fflush(stdout);
+
+	while (!done) {
+		struct io_uring_cqe *cqe;
+
+		if (uring_enter(&ring, 1) == -1 && errno != EINTR) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+
+		while ((cqe = uring_cqe(&ring)) != NULL) {
+			struct conn *c = (struct conn *)(uintptr_t)
+				(cqe->user_data & ~(uint64_t)OP_MASK);
+
+			switch (cqe->user_data & OP_MASK) {
+				case OP_ACCEPT: on_accept(cqe); break;
+				case OP_RECV: on_recv(c, cqe); break;
+				case OP_SEND: on_send(c, cqe); break;
+			}
+			uring_cqe_seen(&ring);
+		}
+
+		if (returned) {
+			uring_bufs_publish(&bufs);
+			returned = 0;
+			rearm_starved();
+		}
+	}
+
+	fprintf(stderr, "echoed %lu messages in %lu io_uring_enter() calls "
+		"(%.3f calls per message)\n", echoed, ring.enters,
+		echoed ? (double)ring.enters / echoed : 0.0);
+
+	unlink(SOCK_PATH);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+** futexring.c -- ping-pong between two processes over a shmdemo.c-style
+** System V shared memory segment, comparing three ways to wait:
+**
+**   futex_ring  ring.h rings with ring_push_wait()/ring_pop_wait(),
+**               which only call into the kernel when the peer sleeps
+**   spin_ring   the same rings with ring_push()/ring_pop(), which spin
+**               and sched_yield()
+**   sysv_sem    a shared buffer handed back and forth with semdemo.c's
+**               semop(), one system call per acquire and release
+**
+** Prints CSV (see bench.h) with round-trip handoff latency.
+**
+** usage: futexring [-n roundtrips]
+*/
+
+#ifndef __linux__
+#warning "futexring needs Linux futexes."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+
+#include "bench.h"
+#include "ring.h"
+
+#define DEFAULT_ROUNDTRIPS 100000
+#define RING_CAP 64
+#define MIN_SIZE 8
+#define MAX_SIZE 4096
+
+union semun {
+	int val;
+	struct semid_ds *buf;
+	unsigned short *array;
+};
+
+enum { PARENT, CHILD };
+enum mode { FUTEX_RING, SPIN_RING, SYSV_SEM };
+
+static const char *mode_name[] = { "futex_ring", "spin_ring", "sysv_sem" };
+
+/*
+** A two-way channel.  Each side sends on its own ring (or buffer) and
+** receives on the other side's.
+*/
+struct chan {
+	enum mode mode;
+	size_t size;
+	char *seg;           /* the attached shared memory segment */
+	struct ring *r[2];   /* ring modes */
+	int semid;           /* sysv_sem: empty/full for each direction */
+};
+
+static void sem_op(int semid, int num, int op)
+{
+	struct sembuf sb = { .sem_num = num, .sem_op = op, .sem_flg = 0 };
+
+	while (semop(semid, &sb, 1) == -1)
+		if (errno != EINTR) {
+			perror("semop");
+			exit(1);
+		}
+}
+
+static void chan_open(struct chan *c, enum mode mode, size_t size)
+{
+	size_t rbytes = (ring_bytes(RING_CAP, size) + 63) & ~(size_t)63;
+	size_t segsize = mode == SYSV_SEM ? 2 * size : 2 * rbytes;
+	int shmid;
+
+	c->mode = mode;
+	c->size = size;
+
+	if ((shmid = shmget(IPC_PRIVATE, segsize, 0600 | IPC_CREAT)) == -1) {
+		perror("shmget");
+		exit(1);
+	}
+	c->seg = shmat(shmid, (void *)0, 0);
+	shmctl(shmid, IPC_RMID, NULL);  /* goes away after the last detach */
+	if (c->seg == (void *)(-1)) {
+		perror("shmat");
+		exit(1);
+	}
+
+	if (mode == SYSV_SEM) {
+		unsigned short init[4] = { 1, 0, 1, 0 };
+		union semun arg = { .array = init };
+
+		if ((c->semid = semget(IPC_PRIVATE, 4, 0600 | IPC_CREAT)) == -1) {
+			perror("semget");
+			exit(1);
+		}
+		if (semctl(c->semid, 0, SETALL, arg) == -1) {
+			perror("semctl");
+			exit(1);
+		}
+	} else {
+		c->r[PARENT] = (struct ring *)c->seg;
+		c->r[CHILD] = (struct ring *)(c->seg + rbytes);
+		ring_init(c->r[PARENT], RING_CAP, size);
+		ring_init(c->r[CHILD], RING_CAP, size);
+	}
+}
+
+static void chan_close(struct chan *c)
+{
+	if (c->mode == SYSV_SEM) semctl(c->semid, 0, IPC_RMID);
+	shmdt(c->seg);
+}
+
+static void chan_send(struct chan *c, int side, const void *rec)
+{
+	switch (c->mode) {
+		case FUTEX_RING: ring_push_wait(c->r[side], rec); break;
+		case SPIN_RING: ring_push(c->r[side], rec); break;
+		case SYSV_SEM:
+			sem_op(c->semid, side * 2, -1);      /* wait for empty */
+			memcpy(c->seg + side * c->size, rec, c->size);
+			sem_op(c->semid, side * 2 + 1, 1);   /* mark full */
+			break;
+	}
+}
+
+static void chan_recv(struct chan *c, int side, void *rec)
+{
+	int from = !side;
+
+	switch (c->mode) {
+		case FUTEX_RING: ring_pop_wait(c->r[from], rec); break;
+		case SPIN_RING: ring_pop(c->r[from], rec); break;
+		case SYSV_SEM:
+			sem_op(c->semid, from * 2 + 1, -1);  /* wait for full */
+			memcpy(rec, c->seg + from * c->size, c->size);
+			sem_op(c->semid, from * 2, 1);       /* mark empty */
+			break;
+	}
+}
+
+static void run(enum mode mode, size_t size, size_t n)
+{
+	struct chan c;
+	struct lat lat;
+	uint64_t t0, elapsed;
+	char *rec;
+	size_t i;
+	pid_t pid;
+
+	chan_open(&c, mode, size);
+	if ((rec = calloc(1, size)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	lat_init(&lat, n);
+
+	fflush(stdout);
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			for (i = 0; i < n; i++) {
+				chan_recv(&c, CHILD, rec);
+				chan_send(&c, CHILD, rec);
+			}
+			_exit(0);
+
+		default:
+			t0 = now_ns();
+			for (i = 0; i < n; i++) {
+				uint64_t t = now_ns();
+
+				chan_send(&c, PARENT, rec);
+				chan_recv(&c, PARENT, rec);
+				lat_add(&lat, now_ns() - t);
+			}
+			elapsed = now_ns() - t0;
+			waitpid(pid, NULL, 0);
+			break;
+	}
+
+	bench_csv_row(mode_name[mode], size, n, elapsed, &lat);
+
+	lat_free(&lat);
+	free(rec);
+	chan_close(&c);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t n = DEFAULT_ROUNDTRIPS, size;
+	int opt;
+	enum mode mode;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n': n = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: futexring [-n roundtrips]\n");
+				exit(1);
+		}
+	}
+
+	bench_csv_header();
+
+	for (size = MIN_SIZE; size <= MAX_SIZE; size *= 8)
+		for (mode = FUTEX_RING; mode <= SYSV_SEM; mode++)
+			run(mode, size, n);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,248 @@
+/*
+** hugebench.c -- random access to a big shared segment with 4K pages
+** and with huge pages (see seg.h)
+**
+** Two ways to hit the segment at random, 64 bytes at a time:
+**
+**   chase  each load's address comes from the one before, so they can't
+**          overlap: this is latency, TLB misses and all
+**   rand   independent loads at random addresses: this is throughput
+**
+** for anonymous (mmap_anon.c-style) and SysV (shmdemo.c-style) segments
+** with 4K, 2M and 1G pages, and a file of your choosing with -f (put it
+** on a hugetlbfs mount).  Page sizes the system can't give us are
+** skipped.  Prints CSV (see bench.h); TLB misses per load, where the
+** kernel lets us count them, go to stderr.
+**
+** usage: hugebench [-m MiB] [-n loads] [-f new_hugetlbfs_file]
+**
+** The -f file is temporary: hugebench makes it, and won't run if it's
+** already there, and removes it when it's done.
+*/
+
+#ifndef __linux__
+#warning "hugebench needs Linux huge pages."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
+#include "seg.h"
+
+#define LINE 64
+#define DEFAULT_MIB 512
+#define DEFAULT_LOADS 5000000
+
+struct config {
+	int type;
+	size_t pagesize;
+	const char *name;
+};
+
+static const struct config configs[] = {
+	{ SEG_ANON, SEG_PAGE_NORMAL, "anon_4k" },
+	{ SEG_ANON, SEG_PAGE_2M, "anon_2m" },
+	{ SEG_ANON, SEG_PAGE_1G, "anon_1g" },
+	{ SEG_SYSV, SEG_PAGE_NORMAL, "sysv_4k" },
+	{ SEG_SYSV, SEG_PAGE_2M, "sysv_2m" },
+	{ SEG_SYSV, SEG_PAGE_1G, "sysv_1g" },
+	{ SEG_FILE, SEG_PAGE_NORMAL, "file" },
+};
+
+/*
+** tlb_counter() -- a perf counter for data TLB load misses in this
+** process, or -1 if we aren't allowed (see perf_event_paranoid)
+*/
+static int tlb_counter(void)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof pe);
+	pe.type = PERF_TYPE_HW_CACHE;
+	pe.size = sizeof pe;
+	pe.config = PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+
+	return *s;
+}
+
+/*
+** link_lines() -- thread one random cycle through every line of the segment
+** (Sattolo's shuffle), so the chase visits them all before repeating
+*/
+static void link_lines(uint64_t *base, uint32_t *perm, size_t nlines)
+{
+	uint64_t seed = 88172645463325252ull;
+	size_t i;
+
+	for (i = 0; i < nlines; i++)
+		perm[i] = i;
+
+	for (i = nlines - 1; i > 0; i--) {
+		size_t j = xorshift(&seed) % i;
+		uint32_t t = perm[i];
+
+		perm[i] = perm[j];
+		perm[j] = t;
+	}
+
+	for (i = 0; i < nlines; i++)
+		base[(size_t)perm[i] * (LINE / 8)] = perm[(i + 1) % nlines];
+}
+
+static void report(const char *name, const char *test, size_t loads,
+	uint64_t ns, int tlb_fd, uint64_t misses)
+{
+	char mech[64];
+
+	snprintf(mech, sizeof mech, "%s_%s", name, test);
+	bench_csv_row(mech, LINE, loads, ns, NULL);
+	fflush(stdout);
+
+	if (tlb_fd != -1)
+		fprintf(stderr, "%s: %.1f ns per load, %.3f dTLB misses per load\n",
+			mech, (double)ns / loads, (double)misses / loads);
+	else
+		fprintf(stderr, "%s: %.1f ns per load\n", mech, (double)ns / loads);
+}
+
+static uint64_t read_counter(int fd)
+{
+	uint64_t v = 0;
+
+	if (fd != -1 && read(fd, &v, sizeof v) != sizeof v) v = 0;
+
+	return v;
+}
+
+static void bench(const struct config *c, size_t size, uint32_t *perm,
+	size_t loads, const char *path, int tlb_fd)
+{
+	volatile uint64_t sink;
+	uint64_t *base, idx, sum, seed = 1, t0, m0;
+	size_t nlines, i;
+	struct seg s;
+
+	if (seg_create(&s, c->type, size, c->pagesize, IPC_PRIVATE, path) == -1) {
+		fprintf(stderr, "%s: %s\n", c->name, strerror(errno));
+		return;
+	}
+	if (s.fallback) {
+		fprintf(stderr, "%s: skipped (%s)\n", c->name, s.how);
+		seg_destroy(&s);
+		return;
+	}
+	fprintf(stderr, "%s: %zu MiB, %s\n", c->name, s.size >> 20, s.how);
+
+	/* linking touches every line, so the page faults are out of the way */
+	base = s.addr;
+	nlines = size / LINE;
+	link_lines(base, perm, nlines);
+
+	/* dependent loads */
+	idx = 0;
+	m0 = read_counter(tlb_fd);
+	t0 = now_ns();
+	for (i = 0; i < loads; i++)
+		idx = base[idx * (LINE / 8)];
+	t0 = now_ns() - t0;
+	sink = idx;
+	report(c->name, "chase", loads, t0, tlb_fd, read_counter(tlb_fd) - m0);
+
+	/* independent loads */
+	sum = 0;
+	m0 = read_counter(tlb_fd);
+	t0 = now_ns();
+	for (i = 0; i < loads; i++)
+		sum += base[(xorshift(&seed) % nlines) * (LINE / 8)];
+	t0 = now_ns() - t0;
+	sink = sum;
+	report(c->name, "rand", loads, t0, tlb_fd, read_counter(tlb_fd) - m0);
+
+	(void)sink;
+	seg_destroy(&s);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t mib = DEFAULT_MIB, loads = DEFAULT_LOADS, size, i;
+	const char *path = NULL;
+	uint32_t *perm;
+	int opt, fd, tlb_fd;
+
+	while ((opt = getopt(argc, argv, "m:n:f:")) != -1) {
+		switch (opt) {
+			case 'm': mib = strtoul(optarg, NULL, 0); break;
+			case 'n': loads = strtoul(optarg, NULL, 0); break;
+			case 'f': path = optarg; break;
+			default:
+				fprintf(stderr, "usage: hugebench [-m MiB] [-n loads] "
+					"[-f new_hugetlbfs_file]\n");
+				exit(1);
+		}
+	}
+
+	size = mib << 20;
+	if (mib == 0 || loads == 0 || size / LINE > UINT32_MAX) {
+		fprintf(stderr, "hugebench: bad arguments\n");
+		exit(1);
+	}
+
+	/* make the file ourselves, so the unlink() below can't take
+	   anybody else's */
+	if (path != NULL) {
+		if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+			perror(path);
+			exit(1);
+		}
+		close(fd);
+	}
+
+	if ((perm = malloc(size / LINE * sizeof *perm)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	if ((tlb_fd = tlb_counter()) != -1)
+		ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+	else
+		fprintf(stderr, "hugebench: can't count TLB misses (%s)\n",
+			strerror(errno));
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (i = 0; i < sizeof configs / sizeof configs[0]; i++) {
+		if (configs[i].type == SEG_FILE && path == NULL) continue;
+		bench(&configs[i], size, perm, loads, path, tlb_fd);
+	}
+
+	if (path != NULL) unlink(path);
+	free(perm);
+
+	return 0;
+}
+
+#endif
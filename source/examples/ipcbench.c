@@ -0,0 +1,535 @@
+/*
+** ipcbench.c -- runs the IPC mechanisms from the other examples
+** non-interactively over a sweep of message sizes and prints CSV
+**
+** For each mechanism and size, the parent streams a batch of messages
+** to the child (for msgs/s and MB/s), then plays ping-pong with it
+** (for round-trip latency percentiles).
+**
+** usage: ipcbench [-l] [-m mechanism] [-s minsize] [-S maxsize]
+**                 [-f factor] [-n msgs]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+#include <sys/mman.h>
+#ifndef __APPLE__
+#include <mqueue.h>
+#endif
+
+#include "bench.h"
+
+#define MIN_SIZE 8
+#define MAX_SIZE (1024 * 1024)
+
+#define STREAM_BYTES (32 * 1024 * 1024)  /* payload moved per stream run */
+#define PING_BYTES (8 * 1024 * 1024)     /* payload moved per ping run */
+
+#define SOCK_PATH "ipcbench_socket"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#if !defined(__APPLE__)
+#define NEED_UNION_SEMUN
+#endif
+
+#ifdef NEED_UNION_SEMUN
+union semun {
+	int val;
+	struct semid_ds *buf;
+	unsigned short *array;
+};
+#endif
+
+enum { PARENT, CHILD };
+
+/*
+** Each mechanism fills in one of these.  setup() runs before the fork
+** and returns -1 if the mechanism can't carry messages of this size;
+** attach() runs in both processes after the fork; teardown() runs in
+** the parent once the child is gone.
+*/
+struct mech {
+	const char *name;
+	const char *example;
+	int (*setup)(size_t size);
+	void (*attach)(int side);
+	int (*send)(int side, const void *buf, size_t len);
+	int (*recv)(int side, void *buf, size_t len);
+	void (*teardown)(void);
+};
+
+static void die(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+/*
+** File descriptor mechanisms (pipe, FIFO, sockets).  After the fork
+** each process has its own copy of these two.
+*/
+static int txfd, rxfd;
+
+static int fd_send(int side, const void *buf, size_t len)
+{
+	(void)side;
+	return writen(txfd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static int fd_recv(int side, void *buf, size_t len)
+{
+	(void)side;
+	return readn(rxfd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static void fd_teardown(void)
+{
+	close(txfd);
+	if (rxfd != txfd) close(rxfd);
+}
+
+/* pipe2.c: one pipe in each direction */
+static int pfds[2][2];
+
+static int pipe_setup(size_t size)
+{
+	(void)size;
+	if (pipe(pfds[PARENT]) == -1 || pipe(pfds[CHILD]) == -1) die("pipe");
+	return 0;
+}
+
+static void pipe_attach(int side)
+{
+	/* we write on our own pipe and read on the other one */
+	txfd = pfds[side][1];
+	rxfd = pfds[!side][0];
+	close(pfds[side][0]);
+	close(pfds[!side][1]);
+}
+
+/* speak.c/tick.c: a FIFO in each direction */
+static char fifo_name[2][64];
+
+static int fifo_setup(size_t size)
+{
+	int i;
+
+	(void)size;
+	for (i = 0; i < 2; i++) {
+		snprintf(fifo_name[i], sizeof fifo_name[i], "ipcbench_fifo%d.%d",
+			i, (int)getpid());
+		if (mkfifo(fifo_name[i], 0600) == -1) die("mkfifo");
+	}
+	return 0;
+}
+
+static void fifo_attach(int side)
+{
+	/* open in the same order on both sides so the opens pair up */
+	if (side == PARENT) {
+		txfd = open(fifo_name[PARENT], O_WRONLY);
+		rxfd = open(fifo_name[CHILD], O_RDONLY);
+	} else {
+		rxfd = open(fifo_name[PARENT], O_RDONLY);
+		txfd = open(fifo_name[CHILD], O_WRONLY);
+	}
+	if (txfd == -1 || rxfd == -1) die("open");
+}
+
+static void fifo_teardown(void)
+{
+	fd_teardown();
+	unlink(fifo_name[PARENT]);
+	unlink(fifo_name[CHILD]);
+}
+
+/* echos.c/echoc.c: a Unix domain stream socket */
+static int lsock;
+
+static int unix_setup(size_t size)
+{
+	struct sockaddr_un local = { .sun_family = AF_UNIX };
+
+	(void)size;
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) die("socket");
+
+	strcpy(local.sun_path, SOCK_PATH);
+	unlink(local.sun_path);
+	if (bind(lsock, (struct sockaddr *)&local, sizeof local) == -1)
+		die("bind");
+	if (listen(lsock, 1) == -1) die("listen");
+
+	return 0;
+}
+
+static void unix_attach(int side)
+{
+	struct sockaddr_un remote = { .sun_family = AF_UNIX };
+	int s;
+
+	if (side == PARENT) {
+		if ((s = accept(lsock, NULL, NULL)) == -1) die("accept");
+	} else {
+		if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) die("socket");
+		strcpy(remote.sun_path, SOCK_PATH);
+		if (connect(s, (struct sockaddr *)&remote, sizeof remote) == -1)
+			die("connect");
+	}
+	close(lsock);
+	txfd = rxfd = s;
+}
+
+static void unix_teardown(void)
+{
+	fd_teardown();
+	unlink(SOCK_PATH);
+}
+
+/* spair.c: a socketpair() */
+static int sv[2];
+
+static int spair_setup(size_t size)
+{
+	(void)size;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) die("socketpair");
+	return 0;
+}
+
+static void spair_attach(int side)
+{
+	txfd = rxfd = sv[side];
+	close(sv[!side]);
+}
+
+/*
+** kirk.c/spock.c: one System V message queue; the parent sends type 1
+** and the child sends type 2.
+*/
+struct my_msgbuf {
+	long mtype;
+	char mtext[1];
+};
+
+static int msqid;
+static struct my_msgbuf *mbuf;
+
+static int msg_setup(size_t size)
+{
+	if ((long)size > read_proc_long("/proc/sys/kernel/msgmax", 8192))
+		return -1;
+
+	if ((msqid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT)) == -1)
+		die("msgget");
+	if ((mbuf = malloc(sizeof *mbuf + size)) == NULL) die("malloc");
+
+	return 0;
+}
+
+static int msg_send(int side, const void *buf, size_t len)
+{
+	mbuf->mtype = side + 1;
+	memcpy(mbuf->mtext, buf, len);
+	return msgsnd(msqid, mbuf, len, 0);
+}
+
+static int msg_recv(int side, void *buf, size_t len)
+{
+	if (msgrcv(msqid, mbuf, len, !side + 1, 0) == -1) return -1;
+	memcpy(buf, mbuf->mtext, len);
+	return 0;
+}
+
+static void msg_teardown(void)
+{
+	msgctl(msqid, IPC_RMID, NULL);
+	free(mbuf);
+}
+
+#ifndef __APPLE__
+/* mq_sender.c/mq_receiver.c: a POSIX message queue in each direction */
+static mqd_t mq[2];
+
+static int mq_setup(size_t size)
+{
+	struct mq_attr attr = {
+		.mq_maxmsg = read_proc_long("/proc/sys/fs/mqueue/msg_max", 10),
+		.mq_msgsize = size,
+	};
+	char name[64];
+	int i;
+
+	if ((long)size > read_proc_long("/proc/sys/fs/mqueue/msgsize_max", 8192))
+		return -1;
+
+	for (i = 0; i < 2; i++) {
+		snprintf(name, sizeof name, "/ipcbench.%d.%d", (int)getpid(), i);
+		mq[i] = mq_open(name, O_RDWR | O_CREAT | O_EXCL, 0600, &attr);
+		if (mq[i] == (mqd_t)-1) {
+			perror("mq_open");
+			if (i == 1) mq_close(mq[0]);
+			return -1;
+		}
+		mq_unlink(name);  /* it lives on until we close it */
+	}
+
+	return 0;
+}
+
+static int mq_send_msg(int side, const void *buf, size_t len)
+{
+	return mq_send(mq[side], buf, len, 0);
+}
+
+static int mq_recv_msg(int side, void *buf, size_t len)
+{
+	return mq_receive(mq[!side], buf, len, NULL) == (ssize_t)len ? 0 : -1;
+}
+
+static void mq_teardown(void)
+{
+	mq_close(mq[PARENT]);
+	mq_close(mq[CHILD]);
+}
+#endif
+
+/*
+** shmdemo.c+semdemo.c and mmap_anon.c: a shared buffer in each
+** direction, each guarded by an "empty" and a "full" semaphore.  The
+** only difference between the two is where the memory comes from.
+*/
+static char *shdata;
+static size_t shsize;
+static int semid;
+
+static int sem_setup(size_t size)
+{
+	unsigned short init[4] = { 1, 0, 1, 0 }; /* empty, full for each way */
+	union semun arg = { .array = init };
+
+	shsize = size;
+	if ((semid = semget(IPC_PRIVATE, 4, 0600 | IPC_CREAT)) == -1)
+		die("semget");
+	if (semctl(semid, 0, SETALL, arg) == -1) die("semctl");
+
+	return 0;
+}
+
+static int sem_op(int num, int op)
+{
+	struct sembuf sb = { .sem_num = num, .sem_op = op, .sem_flg = 0 };
+
+	while (semop(semid, &sb, 1) == -1)
+		if (errno != EINTR) return -1;
+
+	return 0;
+}
+
+static int shm_send(int side, const void *buf, size_t len)
+{
+	if (sem_op(side * 2, -1) == -1) return -1;      /* wait for empty */
+	memcpy(shdata + side * shsize, buf, len);
+	return sem_op(side * 2 + 1, 1);                 /* mark full */
+}
+
+static int shm_recv(int side, void *buf, size_t len)
+{
+	int from = !side;
+
+	if (sem_op(from * 2 + 1, -1) == -1) return -1;  /* wait for full */
+	memcpy(buf, shdata + from * shsize, len);
+	return sem_op(from * 2, 1);                     /* mark empty */
+}
+
+static int shm_setup(size_t size)
+{
+	int shmid;
+
+	if ((shmid = shmget(IPC_PRIVATE, 2 * size, 0600 | IPC_CREAT)) == -1) {
+		perror("shmget");
+		return -1;
+	}
+	shdata = shmat(shmid, (void *)0, 0);
+	shmctl(shmid, IPC_RMID, NULL);  /* goes away after the last detach */
+	if (shdata == (void *)(-1)) die("shmat");
+
+	return sem_setup(size);
+}
+
+static void shm_teardown(void)
+{
+	shmdt(shdata);
+	semctl(semid, 0, IPC_RMID);
+}
+
+static int mmap_setup(size_t size)
+{
+	shdata = mmap(NULL, 2 * size, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (shdata == MAP_FAILED) die("mmap");
+
+	return sem_setup(size);
+}
+
+static void mmap_teardown(void)
+{
+	munmap(shdata, 2 * shsize);
+	semctl(semid, 0, IPC_RMID);
+}
+
+static void no_attach(int side)
+{
+	(void)side;
+}
+
+static struct mech mechs[] = {
+	{ "pipe", "pipe2.c", pipe_setup, pipe_attach, fd_send, fd_recv,
+		fd_teardown },
+	{ "fifo", "speak.c/tick.c", fifo_setup, fifo_attach, fd_send, fd_recv,
+		fifo_teardown },
+	{ "sysv_msg", "kirk.c/spock.c", msg_setup, no_attach, msg_send,
+		msg_recv, msg_teardown },
+#ifndef __APPLE__
+	{ "posix_mq", "mq_sender.c/mq_receiver.c", mq_setup, no_attach,
+		mq_send_msg, mq_recv_msg, mq_teardown },
+#endif
+	{ "sysv_shm_sem", "shmdemo.c+semdemo.c", shm_setup, no_attach,
+		shm_send, shm_recv, shm_teardown },
+	{ "unix_stream", "echos.c/echoc.c", unix_setup, unix_attach, fd_send,
+		fd_recv, unix_teardown },
+	{ "socketpair", "spair.c", spair_setup, spair_attach, fd_send, fd_recv,
+		fd_teardown },
+	{ "mmap_anon_sem", "mmap_anon.c", mmap_setup, no_attach, shm_send,
+		shm_recv, mmap_teardown },
+	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/*
+** run() -- one mechanism, one message size, one CSV row
+*/
+static void run(struct mech *m, size_t size, size_t count)
+{
+	size_t nstream, nping, i;
+	uint64_t t0, elapsed;
+	struct lat lat;
+	char *buf;
+	pid_t pid;
+	int status;
+
+	if (m->setup(size) == -1) {
+		fprintf(stderr, "ipcbench: %s can't do %zu-byte messages, "
+			"skipping\n", m->name, size);
+		return;
+	}
+
+	nstream = count ? count : bench_count(size, STREAM_BYTES, 100, 100000);
+	nping = count ? count : bench_count(size, PING_BYTES, 100, 10000);
+
+	if ((buf = calloc(1, size)) == NULL) die("malloc");
+
+	fflush(stdout);  /* don't let the child inherit buffered output */
+
+	if ((pid = fork()) == -1) die("fork");
+
+	if (pid == 0) {
+		m->attach(CHILD);
+		for (i = 0; i < nstream; i++)
+			if (m->recv(CHILD, buf, size) == -1) die("child recv");
+		if (m->send(CHILD, buf, size) == -1) die("child send");  /* ack */
+
+		for (i = 0; i < nping; i++) {
+			if (m->recv(CHILD, buf, size) == -1) die("child recv");
+			if (m->send(CHILD, buf, size) == -1) die("child send");
+		}
+		_exit(0);
+	}
+
+	m->attach(PARENT);
+
+	t0 = now_ns();
+	for (i = 0; i < nstream; i++)
+		if (m->send(PARENT, buf, size) == -1) die("send");
+	if (m->recv(PARENT, buf, size) == -1) die("recv");  /* wait for ack */
+	elapsed = now_ns() - t0;
+
+	lat_init(&lat, nping);
+	for (i = 0; i < nping; i++) {
+		uint64_t t = now_ns();
+
+		if (m->send(PARENT, buf, size) == -1) die("send");
+		if (m->recv(PARENT, buf, size) == -1) die("recv");
+		lat_add(&lat, now_ns() - t);
+	}
+
+	waitpid(pid, &status, 0);
+	m->teardown();
+
+	bench_csv_row(m->name, size, nstream, elapsed, &lat);
+
+	lat_free(&lat);
+	free(buf);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: ipcbench [-l] [-m mechanism] [-s minsize] "
+		"[-S maxsize] [-f factor] [-n msgs]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *only = NULL;
+	size_t minsize = MIN_SIZE, maxsize = MAX_SIZE, count = 0, size;
+	int factor = 2, opt, found = 0;
+	struct mech *m;
+
+	while ((opt = getopt(argc, argv, "lm:s:S:f:n:")) != -1) {
+		switch (opt) {
+		case 'l':
+			for (m = mechs; m->name != NULL; m++)
+				printf("%-14s %s\n", m->name, m->example);
+			return 0;
+		case 'm': only = optarg; break;
+		case 's': minsize = strtoul(optarg, NULL, 0); break;
+		case 'S': maxsize = strtoul(optarg, NULL, 0); break;
+		case 'f': factor = atoi(optarg); break;
+		case 'n': count = strtoul(optarg, NULL, 0); break;
+		default: usage();
+		}
+	}
+
+	if (minsize == 0 || maxsize < minsize || factor < 2) usage();
+
+	bench_csv_header();
+
+	for (m = mechs; m->name != NULL; m++) {
+		if (only != NULL && strcmp(only, m->name) != 0) continue;
+		found = 1;
+		for (size = minsize; size <= maxsize; size *= factor)
+			run(m, size, count);
+	}
+
+	if (!found) {
+		fprintf(stderr, "ipcbench: no mechanism \"%s\" (try -l)\n", only);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,286 @@
+/*
+** kirkbatch.c -- like kirk.c, but packs lines into batches (see
+** msgbatch.h) so that many lines share one msgsnd()
+**
+** A batch goes out when it's full, at EOF, or when its oldest line has
+** been waiting for the timeout.  Read them with spockbatch.c.
+**
+** usage: kirkbatch [-t timeout_ms]
+**        kirkbatch -b [-n records]    (benchmark; prints CSV)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#include "bench.h"
+#include "msgbatch.h"
+
+#define LINE_LEN 200        /* same as kirk.c's mtext */
+#define DEFAULT_TIMEOUT 100 /* ms */
+
+#define BENCH_MIN 8
+#define BENCH_MAX 4096
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+static char inbuf[4096];
+static size_t inlen;
+static int ineof;
+
+/*
+** next_line() -- copy the next line of stdin into line, with the
+** newline replaced by a NUL.  Waits up to timeout_ms for more input, or
+** forever if timeout_ms is -1.  Returns the length including the NUL, 0
+** at EOF, or -1 on timeout.
+**
+** We can't use fgets() here: stdio may be sitting on buffered lines
+** that poll() knows nothing about.
+*/
+static int next_line(char *line, size_t size, int timeout_ms)
+{
+	for (;;) {
+		char *nl = memchr(inbuf, '\n', inlen);
+		struct pollfd pfd = { .fd = 0, .events = POLLIN };
+		ssize_t n;
+
+		if (nl != NULL || inlen == sizeof inbuf || (ineof && inlen > 0)) {
+			size_t linelen = nl != NULL ? (size_t)(nl - inbuf) : inlen;
+			size_t used = nl != NULL ? linelen + 1 : linelen;
+
+			if (linelen > size - 1) linelen = size - 1;  /* truncate */
+			memcpy(line, inbuf, linelen);
+			line[linelen] = '\0';
+
+			memmove(inbuf, inbuf + used, inlen - used);
+			inlen -= used;
+
+			return linelen + 1;
+		}
+
+		if (ineof) return 0;
+
+		switch (poll(&pfd, 1, timeout_ms)) {
+			case -1:
+				if (errno == EINTR) continue;
+				perror("poll");
+				exit(1);
+
+			case 0:
+				return -1;
+		}
+
+		if ((n = read(0, inbuf + inlen, sizeof inbuf - inlen)) == -1) {
+			if (errno == EINTR) continue;
+			perror("read");
+			exit(1);
+		}
+
+		if (n == 0) ineof = 1;
+		else inlen += n;
+	}
+}
+
+static int talk(int timeout_ms)
+{
+	struct batch b;
+	char line[LINE_LEN];
+	int msqid, len;
+	key_t key;
+
+	if ((key = ftok("kirk.c", 'B')) == -1) {  /* same key as kirk.c */
+		perror("ftok");
+		exit(1);
+	}
+
+	if ((msqid = msgget(key, 0644 | IPC_CREAT)) == -1) {
+		perror("msgget");
+		exit(1);
+	}
+
+	if (batch_init(&b, msqid) == -1) {
+		perror("batch_init");
+		exit(1);
+	}
+
+	printf("Enter lines of text, ^D to quit:\n");
+
+	for (;;) {
+		int wait_ms = -1;
+
+		/* if a batch is started, only wait until it's due */
+		if (b.nrec > 0) {
+			uint64_t age_ms = (now_ns() - b.first_ns) / 1000000;
+			wait_ms = age_ms >= (uint64_t)timeout_ms ? 0 :
+				timeout_ms - (int)age_ms;
+		}
+
+		if ((len = next_line(line, sizeof line, wait_ms)) == 0)
+			break;
+
+		if (len > 0 && batch_add(&b, line, len) == -1)
+			perror("batch_add");
+
+		if (batch_overdue(&b, timeout_ms * 1000000ull) &&
+		    batch_flush(&b) == -1)
+			perror("msgsnd");
+	}
+
+	if (batch_flush(&b) == -1)
+		perror("msgsnd");
+
+	batch_free(&b);
+
+	if (msgctl(msqid, IPC_RMID, NULL) == -1) {
+		perror("msgctl");
+		exit(1);
+	}
+
+	return 0;
+}
+
+/*
+** bench_run() -- send n records of recsize bytes to a child, either one
+** per msgsnd() as kirk.c does or packed into batches.  Returns the
+** elapsed ns once the child has unpacked them all.
+*/
+static uint64_t bench_run(int batched, size_t recsize, size_t n)
+{
+	struct batch_msgbuf *msg;
+	struct batch b;
+	size_t max, i;
+	uint64_t t0;
+	char *rec;
+	int msqid, status;
+	pid_t pid;
+
+	if ((msqid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT)) == -1) {
+		perror("msgget");
+		exit(1);
+	}
+
+	max = batch_msgmax(msqid);
+	if ((msg = malloc(sizeof *msg + max)) == NULL ||
+	    (rec = calloc(1, recsize)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	t0 = now_ns();
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0: {
+			size_t got = 0;
+
+			while (got < n) {
+				ssize_t mlen = msgrcv(msqid, msg, max, 0, 0);
+
+				if (mlen == -1) {
+					if (errno == EINTR) continue;
+					perror("msgrcv");
+					_exit(1);
+				}
+
+				if (msg->mtype == BATCH_MTYPE) {
+					size_t off = 0, len;
+
+					while (batch_next(msg->mtext, mlen, &off, &len) != NULL)
+						got++;
+				} else
+					got++;
+			}
+			_exit(0);
+		}
+	}
+
+	if (batched) {
+		if (batch_init(&b, msqid) == -1) {
+			perror("batch_init");
+			exit(1);
+		}
+		for (i = 0; i < n; i++)
+			if (batch_add(&b, rec, recsize) == -1) {
+				perror("batch_add");
+				exit(1);
+			}
+		if (batch_flush(&b) == -1) {
+			perror("msgsnd");
+			exit(1);
+		}
+		batch_free(&b);
+	} else {
+		msg->mtype = 1;
+		memcpy(msg->mtext, rec, recsize);
+		for (i = 0; i < n; i++)
+			if (msgsnd(msqid, msg, recsize, 0) == -1) {
+				perror("msgsnd");
+				exit(1);
+			}
+	}
+
+	waitpid(pid, &status, 0);
+	t0 = now_ns() - t0;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "kirkbatch: child failed\n");
+		exit(1);
+	}
+
+	msgctl(msqid, IPC_RMID, NULL);
+	free(rec);
+	free(msg);
+
+	return t0;
+}
+
+static int bench(size_t records)
+{
+	size_t recsize;
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (recsize = BENCH_MIN; recsize <= BENCH_MAX; recsize *= 2) {
+		size_t n = records ? records :
+			bench_count(recsize, BENCH_BYTES, 10000, 1000000);
+
+		bench_csv_row("sysv_msg", recsize, n, bench_run(0, recsize, n),
+			NULL);
+		bench_csv_row("sysv_msg_batch", recsize, n,
+			bench_run(1, recsize, n), NULL);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, timeout_ms = DEFAULT_TIMEOUT, benchmark = 0;
+	size_t records = 0;
+
+	while ((opt = getopt(argc, argv, "t:bn:")) != -1) {
+		switch (opt) {
+			case 't': timeout_ms = atoi(optarg); break;
+			case 'b': benchmark = 1; break;
+			case 'n': records = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: kirkbatch [-t timeout_ms] | "
+					"kirkbatch -b [-n records]\n");
+				exit(1);
+		}
+	}
+
+	if (timeout_ms < 0) timeout_ms = 0;
+
+	return benchmark ? bench(records) : talk(timeout_ms);
+}
@@ -0,0 +1,94 @@
+/*
+** kirkshard.c -- like kirk.c, but shards lines across a spockpool.c
+** worker pool by key
+**
+** Each line is "key text".  Lines with the same key always get the
+** same mtype, so they go to the same worker, in order.
+**
+** usage: kirkshard [-w workers]   (use the same count as spockpool)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#define DEFAULT_WORKERS 4
+
+struct my_msgbuf {
+	long mtype;
+	char mtext[200];
+};
+
+/*
+** shard() -- FNV-1a hash of the key, folded onto types 1..nworkers
+*/
+long shard(const char *key, int nworkers)
+{
+	unsigned long h = 2166136261ul;
+
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619ul;
+	}
+
+	return h % nworkers + 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct my_msgbuf buf;
+	int msqid, opt, nworkers = DEFAULT_WORKERS;
+	key_t key;
+
+	while ((opt = getopt(argc, argv, "w:")) != -1) {
+		switch (opt) {
+			case 'w': nworkers = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: kirkshard [-w workers]\n");
+				exit(1);
+		}
+	}
+
+	if (nworkers < 1) {
+		fprintf(stderr, "kirkshard: need at least one worker\n");
+		exit(1);
+	}
+
+	if ((key = ftok("kirk.c", 'B')) == -1) {  /* same key as kirk.c */
+		perror("ftok");
+		exit(1);
+	}
+
+	if ((msqid = msgget(key, 0644 | IPC_CREAT)) == -1) {
+		perror("msgget");
+		exit(1);
+	}
+
+	printf("Enter lines of \"key text\", ^D to quit:\n");
+
+	while(fgets(buf.mtext, sizeof buf.mtext, stdin) != NULL) {
+		int len = strlen(buf.mtext);
+		char k[sizeof buf.mtext];
+
+		/* ditch newline at end, if it exists */
+		if (buf.mtext[len-1] == '\n') buf.mtext[len-1] = '\0';
+
+		if (sscanf(buf.mtext, "%199s", k) != 1) continue;
+		buf.mtype = shard(k, nworkers);
+
+		if (msgsnd(msqid, &buf, len, 0) == -1)
+			perror("msgsnd");
+	}
+
+	if (msgctl(msqid, IPC_RMID, NULL) == -1) {
+		perror("msgctl");
+		exit(1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,368 @@
+/*
+** lockbench.c -- N processes updating random records of one file,
+** locking the whole file the lockdemo.c way or just the record with
+** rangelock.h, to see how much the whole-file lock costs
+**
+** A record is a counter and some filler.  An update locks, pread()s the
+** record, bumps the counter, pwrite()s it back, and unlocks.  At the end
+** the counters have to add up to the number of updates made, or the
+** locks let two updates of a record overlap.
+**
+** Prints CSV (see bench.h) for 1, 2, 4, ... workers, whole file and then
+** per record, and on stderr how often a lock had to wait, for how long,
+** and which record was waited on the most.
+**
+** usage: lockbench [-w max_workers] [-n records] [-s record_size] [-t ms]
+**                  [-T] [-P] [new_file]
+**
+**   -T  threads instead of processes, each with its own open()
+**   -P  classic process-owned F_SETLKW locks instead of OFD locks
+**
+** The records live in lockbench.dat, which is rewritten every round and
+** removed at the end.  A file named on the command line is created
+** instead, and kept; if it already exists, lockbench refuses it rather
+** than write over it.
+**
+** -T -P together shows why OFD locks exist: threads in one process
+** don't block each other's process locks, and updates get lost.
+*/
+
+#ifndef __linux__
+#warning "lockbench needs Linux OFD locks."
+int main(void) {}
+#else
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "rangelock.h"
+
+#define MAX_WORKERS 256
+#define DEFAULT_RECS 1024
+#define DEFAULT_RECSIZE 128
+#define MAX_RECSIZE 65536
+#define SCRATCH_FILE "lockbench.dat"
+#define CACHELINE 64
+
+enum { WHOLE_FILE, RECORD };
+
+static const char *mech_names[] = { "file", "record" };
+
+/* everything the workers share; lives in a MAP_SHARED mapping */
+struct shared {
+	int ready, go, stop;
+
+	struct {
+		_Alignas(CACHELINE) unsigned long updates;
+	} worker[MAX_WORKERS];
+
+	_Alignas(CACHELINE) struct rlock_stats stats[];  /* one per record */
+};
+
+struct worker_arg {
+	int id;
+};
+
+static struct shared *sh;
+static const char *path;
+static size_t nrecs = DEFAULT_RECS, recsize = DEFAULT_RECSIZE;
+static int mech, ofd = 1;
+
+/*
+** A record on disk: the counter, then filler.  recsize is at least
+** sizeof(uint64_t).
+*/
+static void update(struct rlock *rl, int fd, size_t rec, unsigned char *buf)
+{
+	uint64_t count;
+
+	if ((mech == WHOLE_FILE ? rlock_lock(rl, 0, 0, F_WRLCK) :
+	    rlock_lock(rl, rec, 1, F_WRLCK)) == -1) {
+		perror("fcntl");
+		exit(1);
+	}
+
+	if (pread(fd, buf, recsize, rec * recsize) != (ssize_t)recsize) {
+		perror("pread");
+		exit(1);
+	}
+
+	memcpy(&count, buf, sizeof count);
+	count++;
+	memcpy(buf, &count, sizeof count);
+	memset(buf + sizeof count, 'a' + count % 26, recsize - sizeof count);
+
+	if (pwrite(fd, buf, recsize, rec * recsize) != (ssize_t)recsize) {
+		perror("pwrite");
+		exit(1);
+	}
+
+	if ((mech == WHOLE_FILE ? rlock_unlock(rl, 0, 0) :
+	    rlock_unlock(rl, rec, 1)) == -1) {
+		perror("fcntl");
+		exit(1);
+	}
+}
+
+static void *worker(void *arg)
+{
+	int id = ((struct worker_arg *)arg)->id;
+	uint64_t x = 88172645463325252ull ^ ((uint64_t)id << 32 | 1);
+	unsigned long updates = 0;
+	unsigned char buf[recsize];
+	struct rlock rl;
+	int fd;
+
+	/* our own open(), so OFD locks are ours alone */
+	if ((fd = open(path, O_RDWR)) == -1) {
+		perror(path);
+		exit(1);
+	}
+	rlock_init(&rl, fd, recsize, nrecs, sh->stats, ofd);
+
+	__atomic_fetch_add(&sh->ready, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&sh->go, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	while (!__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) {
+		/* xorshift64; good enough to pick records */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+
+		update(&rl, fd, x % nrecs, buf);
+		updates++;
+	}
+
+	sh->worker[id].updates = updates;
+	close(fd);
+
+	return NULL;
+}
+
+/*
+** make_file() -- fill the file with nrecs zeroed records.  flags are
+** added to the open(): main() creates the file with O_CREAT and O_TRUNC
+** or O_EXCL, and each round just zeroes it again.
+*/
+static void make_file(int flags)
+{
+	unsigned char buf[recsize];
+	size_t i;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | flags, 0644)) == -1) {
+		perror(path);
+		exit(1);
+	}
+
+	memset(buf, 0, sizeof buf);
+	for (i = 0; i < nrecs; i++)
+		if (writen(fd, buf, recsize) == -1) {
+			perror("write");
+			exit(1);
+		}
+
+	close(fd);
+}
+
+/*
+** file_total() -- add up the counters in every record
+*/
+static uint64_t file_total(void)
+{
+	unsigned char buf[recsize];
+	uint64_t total = 0, count;
+	size_t i;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		perror(path);
+		exit(1);
+	}
+
+	for (i = 0; i < nrecs; i++) {
+		if (pread(fd, buf, recsize, i * recsize) != (ssize_t)recsize) {
+			perror("pread");
+			exit(1);
+		}
+		memcpy(&count, buf, sizeof count);
+		total += count;
+	}
+
+	close(fd);
+
+	return total;
+}
+
+/*
+** run() -- one round: n workers for ms milliseconds
+*/
+static void run(int n, unsigned ms, int threads)
+{
+	struct worker_arg args[MAX_WORKERS];
+	pthread_t tids[MAX_WORKERS];
+	uint64_t elapsed, locks = 0, conflicts = 0, wait_ns = 0, wait_max = 0;
+	unsigned long updates = 0;
+	size_t i, hot = 0;
+	uint64_t total;
+	char name[64];
+	int status;
+
+	make_file(0);
+	memset(sh, 0, sizeof *sh + nrecs * sizeof sh->stats[0]);
+
+	for (i = 0; i < (size_t)n; i++) {
+		args[i].id = i;
+
+		if (threads) {
+			if ((errno = pthread_create(&tids[i], NULL, worker,
+			    &args[i])) != 0) {
+				perror("pthread_create");
+				exit(1);
+			}
+			continue;
+		}
+
+		switch (fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0:
+				worker(&args[i]);
+				_exit(0);
+		}
+	}
+
+	while (__atomic_load_n(&sh->ready, __ATOMIC_SEQ_CST) < n)
+		sched_yield();
+
+	elapsed = now_ns();
+	__atomic_store_n(&sh->go, 1, __ATOMIC_RELEASE);
+	usleep(ms * 1000);
+	__atomic_store_n(&sh->stop, 1, __ATOMIC_RELAXED);
+
+	if (threads)
+		for (i = 0; i < (size_t)n; i++)
+			pthread_join(tids[i], NULL);
+	else
+		while (wait(&status) != -1)
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				fprintf(stderr, "lockbench: a worker failed\n");
+				exit(1);
+			}
+	elapsed = now_ns() - elapsed;
+
+	for (i = 0; i < (size_t)n; i++)
+		updates += sh->worker[i].updates;
+
+	for (i = 0; i < nrecs; i++) {
+		locks += sh->stats[i].locks;
+		conflicts += sh->stats[i].conflicts;
+		wait_ns += sh->stats[i].wait_ns;
+		if (sh->stats[i].wait_max_ns > wait_max)
+			wait_max = sh->stats[i].wait_max_ns;
+		if (sh->stats[i].wait_ns > sh->stats[hot].wait_ns) hot = i;
+	}
+
+	snprintf(name, sizeof name, "%s%s_%d%s", mech_names[mech],
+		ofd ? "" : "_posix", n, threads ? "t" : "p");
+	bench_csv_row(name, recsize, updates, elapsed, NULL);
+	fflush(stdout);
+
+	fprintf(stderr, "%s: %lu updates, %.1f%% of locks waited, %.1f us "
+		"on average, %.1f us at most", name, updates,
+		locks ? 100.0 * conflicts / locks : 0.0,
+		conflicts ? wait_ns / 1000.0 / conflicts : 0.0, wait_max / 1000.0);
+	if (mech == RECORD && sh->stats[hot].conflicts)
+		fprintf(stderr, "; record %zu waited %lu times", hot,
+			(unsigned long)sh->stats[hot].conflicts);
+	fprintf(stderr, "\n");
+
+	if ((total = file_total()) != updates)
+		fprintf(stderr, "%s: LOST UPDATES! counters add up to %llu, "
+			"not %lu\n", name, (unsigned long long)total, updates);
+}
+
+int main(int argc, char *argv[])
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, n, maxw = 0, threads = 0, scratch = 1;
+	unsigned ms = 300;
+	size_t shsize;
+
+	while ((opt = getopt(argc, argv, "w:n:s:t:TP")) != -1) {
+		switch (opt) {
+			case 'w': maxw = atoi(optarg); break;
+			case 'n': nrecs = strtoul(optarg, NULL, 0); break;
+			case 's': recsize = strtoul(optarg, NULL, 0); break;
+			case 't': ms = strtoul(optarg, NULL, 0); break;
+			case 'T': threads = 1; break;
+			case 'P': ofd = 0; break;
+			default:
+				fprintf(stderr, "usage: lockbench [-w max_workers] "
+					"[-n records] [-s record_size] [-t ms] [-T] [-P] "
+					"[new_file]\n");
+				exit(1);
+		}
+	}
+
+	if (maxw <= 0) maxw = ncpu > 2 ? ncpu : 4;
+	if (maxw > MAX_WORKERS) maxw = MAX_WORKERS;
+	if (nrecs == 0) nrecs = 1;
+	if (recsize < sizeof(uint64_t)) recsize = sizeof(uint64_t);
+	if (recsize > MAX_RECSIZE) {
+		fprintf(stderr, "lockbench: record size can be at most %d\n",
+			MAX_RECSIZE);
+		exit(1);
+	}
+
+	/* only our own scratch file may be clobbered */
+	path = SCRATCH_FILE;
+	if (optind < argc) {
+		path = argv[optind];
+		scratch = 0;
+	}
+	make_file(O_CREAT | (scratch ? O_TRUNC : O_EXCL));
+
+#ifndef F_OFD_SETLKW
+	if (ofd) {
+		fprintf(stderr, "lockbench: no OFD locks here; using F_SETLKW\n");
+		ofd = 0;
+	}
+#endif
+
+	shsize = sizeof *sh + nrecs * sizeof sh->stats[0];
+	sh = mmap(NULL, shsize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (mech = WHOLE_FILE; mech <= RECORD; mech++)
+		for (n = 1; n <= maxw; n = n * 2 > maxw && n < maxw ? maxw : n * 2)
+			run(n, ms, threads);
+
+	munmap(sh, shsize);
+	if (scratch) unlink(path);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,300 @@
+/*
+** locktable.h -- record locks for a data file kept in a shared mapping
+** next to it, so that taking a lock nobody else holds is no system call
+** at all
+**
+** Every fcntl() lock or unlock in lockdemo.c (and rangelock.h) is a trip
+** into the kernel, which keeps a list of locks for each file.  Here the
+** locks live in "<file>.locks", which every process maps.  Records hash
+** into a fixed number of buckets, and each bucket is a process-shared
+** pthread mutex.  glibc builds those on a word in the mapping: locking
+** a free one is an atomic compare-and-swap of our thread ID into it, and
+** only a process that has to wait makes a futex() call, as does the one
+** that wakes it.  Two records that hash to the same bucket share a
+** lock, which costs some needless waiting but never correctness.
+**
+** The mutexes are also PTHREAD_MUTEX_ROBUST.  If a process dies holding
+** one, the kernel marks it and the next locker gets it with EOWNERDEAD
+** instead of waiting forever; lt_lock() then makes the mutex usable
+** again and returns LT_RECOVERED so the caller knows the records it
+** just locked may be half written.
+**
+** The lock file is built under a temporary name and link()ed into
+** place, so nobody can map it before it's initialized, and two processes
+** racing to create it can't both do so.
+**
+** Linux only: robust mutexes in shared memory need the kernel's robust
+** futex list.
+*/
+
+#ifndef LOCKTABLE_H
+#define LOCKTABLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define LT_MAGIC 0x4c4f434bu  /* "LOCK" */
+#define LT_CACHELINE 64
+#define LT_MAX_SPAN 64  /* longer ranges just lock every bucket */
+#define LT_RECOVERED 1
+
+/* one lock, on its own cache line so neighbors don't bounce it */
+struct lt_bucket {
+	_Alignas(LT_CACHELINE) pthread_mutex_t mutex;
+	uint64_t waits;       /* times a locker found it held */
+	uint64_t recoveries;  /* times its holder died */
+};
+
+struct locktable {
+	uint32_t magic;
+	uint32_t nbuckets;  /* a power of two */
+	size_t size;        /* of the whole mapping */
+	struct lt_bucket bucket[];
+};
+
+static inline size_t lt_bytes(uint32_t nbuckets)
+{
+	return sizeof(struct locktable) + nbuckets * sizeof(struct lt_bucket);
+}
+
+static inline uint32_t lt_hash(const struct locktable *lt, size_t rec)
+{
+	/* Fibonacci hashing: neighboring records land far apart */
+	return (uint32_t)(((uint64_t)rec * 11400714819323198485ull) >> 32) &
+		(lt->nbuckets - 1);
+}
+
+static inline int lt_init(struct locktable *lt, uint32_t nbuckets)
+{
+	pthread_mutexattr_t ma;
+	uint32_t i;
+
+	if ((errno = pthread_mutexattr_init(&ma)) != 0) return -1;
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+
+	lt->nbuckets = nbuckets;
+	lt->size = lt_bytes(nbuckets);
+
+	for (i = 0; i < nbuckets; i++) {
+		lt->bucket[i].waits = lt->bucket[i].recoveries = 0;
+		if ((errno = pthread_mutex_init(&lt->bucket[i].mutex, &ma)) != 0) {
+			pthread_mutexattr_destroy(&ma);
+			return -1;
+		}
+	}
+
+	pthread_mutexattr_destroy(&ma);
+	lt->magic = LT_MAGIC;
+
+	return 0;
+}
+
+/*
+** lt_map() -- map an existing lock file and check that it is one
+*/
+static inline struct locktable *lt_map(int fd)
+{
+	struct locktable *lt;
+	struct stat sb;
+
+	if (fstat(fd, &sb) == -1) return NULL;
+	if ((size_t)sb.st_size < sizeof *lt) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	lt = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (lt == MAP_FAILED) return NULL;
+
+	if (lt->magic != LT_MAGIC || lt->size != (size_t)sb.st_size) {
+		munmap(lt, sb.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return lt;
+}
+
+/*
+** lt_open() -- map the lock table for datapath, creating it with
+** nbuckets buckets (a power of two) if it isn't there yet.  An existing
+** table keeps the bucket count it was made with.  Returns NULL with
+** errno set on error.
+*/
+static inline struct locktable *lt_open(const char *datapath,
+	uint32_t nbuckets)
+{
+	char path[4096], tmp[4096 + 16];
+	struct locktable *lt;
+	int fd, e;
+
+	if (nbuckets == 0 || (nbuckets & (nbuckets - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((size_t)snprintf(path, sizeof path, "%s.locks", datapath) >=
+	    sizeof path) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	for (;;) {
+		if ((fd = open(path, O_RDWR)) != -1) {
+			lt = lt_map(fd);
+			e = errno;
+			close(fd);
+			errno = e;
+			return lt;
+		}
+		if (errno != ENOENT) return NULL;
+
+		/* not there; build one off to the side */
+		snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+		if ((fd = mkstemp(tmp)) == -1) return NULL;
+
+		if (ftruncate(fd, lt_bytes(nbuckets)) == -1 ||
+		    (lt = mmap(NULL, lt_bytes(nbuckets), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			e = errno;
+			close(fd);
+			unlink(tmp);
+			errno = e;
+			return NULL;
+		}
+		close(fd);
+
+		if (lt_init(lt, nbuckets) == -1 || link(tmp, path) == -1) {
+			e = errno;
+			munmap(lt, lt_bytes(nbuckets));
+			unlink(tmp);
+			if (e == EEXIST) continue;  /* lost the race; use theirs */
+			errno = e;
+			return NULL;
+		}
+
+		unlink(tmp);
+		return lt;
+	}
+}
+
+static inline void lt_close(struct locktable *lt)
+{
+	munmap(lt, lt->size);
+}
+
+static inline int lt_lock_bucket(struct locktable *lt, uint32_t b)
+{
+	struct lt_bucket *bk = &lt->bucket[b];
+	int r;
+
+	if ((r = pthread_mutex_trylock(&bk->mutex)) == EBUSY) {
+		__atomic_fetch_add(&bk->waits, 1, __ATOMIC_RELAXED);
+		r = pthread_mutex_lock(&bk->mutex);
+	}
+
+	if (r == EOWNERDEAD) {
+		/* the last holder died; it's ours now, but maybe a mess */
+		pthread_mutex_consistent(&bk->mutex);
+		__atomic_fetch_add(&bk->recoveries, 1, __ATOMIC_RELAXED);
+		return LT_RECOVERED;
+	}
+
+	if (r != 0) {
+		errno = r;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lt_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+** lt_buckets() -- the buckets covering records rec..rec+n-1, sorted
+** and without repeats.  Everyone takes buckets in increasing order, so
+** two lockers of overlapping ranges can't deadlock.  Returns how many,
+** or 0 for "all of them".
+*/
+static inline size_t lt_buckets(struct locktable *lt, size_t rec, size_t n,
+	uint32_t *b)
+{
+	size_t i, m = 0;
+
+	if (n >= lt->nbuckets || n > LT_MAX_SPAN) return 0;
+
+	for (i = 0; i < n; i++)
+		b[i] = lt_hash(lt, rec + i);
+	qsort(b, n, sizeof *b, lt_cmp);
+
+	for (i = 0; i < n; i++)
+		if (m == 0 || b[i] != b[m - 1]) b[m++] = b[i];
+
+	return m;
+}
+
+/*
+** lt_lock() -- lock records rec through rec+n-1; n == 0 locks every
+** bucket, and so the whole file.  Returns 0, or LT_RECOVERED if a
+** holder of one of the locks died holding it, or -1 with errno set on
+** error.
+*/
+static inline int lt_lock(struct locktable *lt, size_t rec, size_t n)
+{
+	uint32_t b[LT_MAX_SPAN];
+	size_t i, m;
+	int r, ret = 0;
+
+	if (n == 1) return lt_lock_bucket(lt, lt_hash(lt, rec));
+
+	m = lt_buckets(lt, rec, n, b);
+
+	for (i = 0; i < (m ? m : lt->nbuckets); i++) {
+		if ((r = lt_lock_bucket(lt, m ? b[i] : i)) == -1) {
+			int e = errno;
+			while (i-- > 0)
+				pthread_mutex_unlock(&lt->bucket[m ? b[i] : i].mutex);
+			errno = e;
+			return -1;
+		}
+		if (r == LT_RECOVERED) ret = LT_RECOVERED;
+	}
+
+	return ret;
+}
+
+/*
+** lt_unlock() -- unlock the records lt_lock() locked
+*/
+static inline void lt_unlock(struct locktable *lt, size_t rec, size_t n)
+{
+	uint32_t b[LT_MAX_SPAN];
+	size_t i, m;
+
+	if (n == 1) {
+		pthread_mutex_unlock(&lt->bucket[lt_hash(lt, rec)].mutex);
+		return;
+	}
+
+	m = lt_buckets(lt, rec, n, b);
+
+	for (i = 0; i < (m ? m : lt->nbuckets); i++)
+		pthread_mutex_unlock(&lt->bucket[m ? b[i] : i].mutex);
+}
+
+#endif
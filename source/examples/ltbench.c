@@ -0,0 +1,337 @@
+/*
+** ltbench.c -- what it costs to lock and unlock a record: fcntl() (via
+** rangelock.h) against the shared-memory lock table in locktable.h
+**
+** 1, 2, 4, ... up to 64 processes each lock a random record, bump a
+** counter for it in shared memory, and unlock, over and over.  Every
+** 16th round trip is timed.  Prints CSV (see bench.h) with the round
+** trips per second and their latency, and on stderr how often a locker
+** had to wait.  The counters have to add up to the number of round
+** trips, or the locks didn't keep updates apart.
+**
+** First, though, a child takes a lock-table lock and dies holding it, to
+** show the next locker getting it back (LT_RECOVERED) instead of
+** hanging.
+**
+** usage: ltbench [-p max_procs] [-n records] [-b buckets] [-t ms]
+**                [new_file]
+**
+** -n 1 puts everyone on the same record.
+**
+** The records live in ltbench.dat and the lock table in ltbench.dat.locks,
+** both rewritten as needed and removed at the end.  A file named on the
+** command line is created instead, and kept, with its lock table in
+** <new_file>.locks.  If either one already exists, ltbench refuses it
+** rather than write over it.
+*/
+
+#ifndef __linux__
+#warning "ltbench needs Linux robust futexes."
+int main(void) {}
+#else
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "rangelock.h"
+#include "locktable.h"
+
+#define MAX_PROCS 64
+#define DEFAULT_RECS 1024
+#define DEFAULT_BUCKETS 1024
+#define RECSIZE 64
+#define SAMPLE_EVERY 16
+#define MAX_SAMPLES 8192  /* per process */
+#define SCRATCH_FILE "ltbench.dat"
+#define CACHELINE 64
+
+enum { FCNTL, LOCKTABLE };
+
+static const char *mech_names[] = { "fcntl", "locktable" };
+
+/* everything the processes share; lives in a MAP_SHARED mapping */
+struct shared {
+	int ready, go, stop;
+
+	struct {
+		_Alignas(CACHELINE) unsigned long ops;
+		size_t nsamples;
+	} proc[MAX_PROCS];
+
+	uint64_t samples[MAX_PROCS][MAX_SAMPLES];
+
+	/* protected by the record locks, not atomics */
+	_Alignas(CACHELINE) unsigned long count[];
+};
+
+static struct shared *sh;
+static const char *path;
+static size_t nrecs = DEFAULT_RECS;
+
+static void worker(int mech, int id, struct locktable *lt)
+{
+	uint64_t x = 88172645463325252ull ^ ((uint64_t)id << 32 | 1);
+	unsigned long ops = 0;
+	size_t nsamples = 0;
+	struct rlock rl;
+	int fd = -1;
+
+	if (mech == FCNTL) {
+		/* our own open(), so the OFD locks are ours alone */
+		if ((fd = open(path, O_RDWR)) == -1) {
+			perror(path);
+			exit(1);
+		}
+		rlock_init(&rl, fd, RECSIZE, nrecs, NULL, 1);
+	}
+
+	__atomic_fetch_add(&sh->ready, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&sh->go, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	while (!__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) {
+		uint64_t t0 = 0;
+		size_t rec;
+		int r;
+
+		/* xorshift64; good enough to pick records */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		rec = x % nrecs;
+
+		if (ops % SAMPLE_EVERY == 0) t0 = now_ns();
+
+		r = mech == FCNTL ? rlock_lock(&rl, rec, 1, F_WRLCK) :
+			lt_lock(lt, rec, 1);
+		if (r == -1) {
+			perror("lock");
+			exit(1);
+		}
+
+		sh->count[rec]++;
+
+		if (mech == FCNTL) rlock_unlock(&rl, rec, 1);
+		else lt_unlock(lt, rec, 1);
+
+		if (ops % SAMPLE_EVERY == 0 && nsamples < MAX_SAMPLES)
+			sh->samples[id][nsamples++] = now_ns() - t0;
+		ops++;
+	}
+
+	sh->proc[id].ops = ops;
+	sh->proc[id].nsamples = nsamples;
+	if (fd != -1) close(fd);
+}
+
+/*
+** waits() -- how many times a locker has found a lock-table bucket held
+*/
+static uint64_t waits(const struct locktable *lt)
+{
+	uint64_t w = 0;
+	uint32_t i;
+
+	for (i = 0; i < lt->nbuckets; i++)
+		w += lt->bucket[i].waits;
+
+	return w;
+}
+
+/*
+** run() -- one round: n processes for ms milliseconds
+*/
+static void run(int mech, int n, unsigned ms, struct locktable *lt)
+{
+	unsigned long ops = 0, total = 0;
+	uint64_t elapsed, waits0 = waits(lt);
+	struct lat l;
+	char name[64];
+	size_t i, j;
+	int status;
+
+	memset(sh, 0, sizeof *sh + nrecs * sizeof sh->count[0]);
+
+	for (i = 0; i < (size_t)n; i++) {
+		switch (fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0:
+				worker(mech, i, lt);
+				_exit(0);
+		}
+	}
+
+	while (__atomic_load_n(&sh->ready, __ATOMIC_SEQ_CST) < n)
+		sched_yield();
+
+	elapsed = now_ns();
+	__atomic_store_n(&sh->go, 1, __ATOMIC_RELEASE);
+	usleep(ms * 1000);
+	__atomic_store_n(&sh->stop, 1, __ATOMIC_RELAXED);
+
+	while (wait(&status) != -1)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "ltbench: a child failed\n");
+			exit(1);
+		}
+	elapsed = now_ns() - elapsed;
+
+	lat_init(&l, (size_t)n * MAX_SAMPLES);
+	for (i = 0; i < (size_t)n; i++) {
+		ops += sh->proc[i].ops;
+		for (j = 0; j < sh->proc[i].nsamples; j++)
+			lat_add(&l, sh->samples[i][j]);
+	}
+	for (i = 0; i < nrecs; i++)
+		total += sh->count[i];
+
+	snprintf(name, sizeof name, "%s_%dp", mech_names[mech], n);
+	bench_csv_row(name, RECSIZE, ops, elapsed, &l);
+	fflush(stdout);
+	lat_free(&l);
+
+	if (mech == LOCKTABLE)
+		fprintf(stderr, "%s: %lu lock/unlocks, %.2f%% waited\n", name, ops,
+			ops ? 100.0 * (waits(lt) - waits0) / ops : 0.0);
+	else
+		fprintf(stderr, "%s: %lu lock/unlocks\n", name, ops);
+
+	if (total != ops)
+		fprintf(stderr, "%s: LOST UPDATES! counters add up to %lu, not "
+			"%lu\n", name, total, ops);
+}
+
+/*
+** die_holding() -- have a child take a lock and exit without unlocking,
+** then take it ourselves
+*/
+static void die_holding(struct locktable *lt)
+{
+	int status, r;
+
+	switch (fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			if (lt_lock(lt, 0, 1) == -1) {
+				perror("lt_lock");
+				_exit(1);
+			}
+			_exit(0);  /* still holding it */
+	}
+	wait(&status);
+
+	if ((r = lt_lock(lt, 0, 1)) == -1) {
+		perror("lt_lock");
+		exit(1);
+	}
+	lt_unlock(lt, 0, 1);
+
+	fprintf(stderr, "holder died: %s\n", r == LT_RECOVERED ?
+		"lock recovered" : "lock was free?!");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, mech, n, maxp = MAX_PROCS, scratch = 1, fd;
+	unsigned ms = 300, nbuckets = DEFAULT_BUCKETS;
+	char lockpath[4096];
+	struct locktable *lt;
+	size_t shsize, i;
+
+	while ((opt = getopt(argc, argv, "p:n:b:t:")) != -1) {
+		switch (opt) {
+			case 'p': maxp = atoi(optarg); break;
+			case 'n': nrecs = strtoul(optarg, NULL, 0); break;
+			case 'b': nbuckets = strtoul(optarg, NULL, 0); break;
+			case 't': ms = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: ltbench [-p max_procs] [-n records] "
+					"[-b buckets] [-t ms] [new_file]\n");
+				exit(1);
+		}
+	}
+
+	if (maxp <= 0 || maxp > MAX_PROCS) maxp = MAX_PROCS;
+	if (nrecs == 0) nrecs = 1;
+
+	path = SCRATCH_FILE;
+	if (optind < argc) {
+		path = argv[optind];
+		scratch = 0;
+	}
+
+	/* start from a fresh lock table, in case an old one's a different
+	   size: a stale scratch one goes, and anybody else's is refused */
+	snprintf(lockpath, sizeof lockpath, "%s.locks", path);
+	if (scratch)
+		unlink(lockpath);
+	else if (access(lockpath, F_OK) == 0) {
+		fprintf(stderr, "%s: File exists\n", lockpath);
+		exit(1);
+	}
+
+	/* the fcntl() locks need a file with the records in it; only our
+	   own scratch file may be clobbered */
+	if ((fd = open(path, O_RDWR | O_CREAT | (scratch ? O_TRUNC : O_EXCL),
+	    0644)) == -1) {
+		perror(path);
+		exit(1);
+	}
+	if (ftruncate(fd, nrecs * RECSIZE) == -1) {
+		perror("ftruncate");
+		exit(1);
+	}
+	close(fd);
+
+	if ((lt = lt_open(path, nbuckets)) == NULL) {
+		perror("lt_open");
+		exit(1);
+	}
+
+	shsize = sizeof *sh + nrecs * sizeof sh->count[0];
+	sh = mmap(NULL, shsize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	die_holding(lt);
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (mech = FCNTL; mech <= LOCKTABLE; mech++)
+		for (n = 1; n <= maxp; n = n * 2 > maxp && n < maxp ? maxp : n * 2)
+			run(mech, n, ms, lt);
+
+	for (i = 0; i < lt->nbuckets; i++)
+		if (lt->bucket[i].recoveries)
+			fprintf(stderr, "bucket %zu recovered %lu times\n", i,
+				(unsigned long)lt->bucket[i].recoveries);
+
+	munmap(sh, shsize);
+	lt_close(lt);
+	unlink(lockpath);
+	if (scratch) unlink(path);
+
+	return 0;
+}
+
+#endif
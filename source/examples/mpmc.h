@@ -0,0 +1,194 @@
+/*
+** mpmc.h -- a lock-free multi-producer/multi-consumer queue of fixed-size
+** records that lives in shared memory
+**
+** ring.h only works with one process on each end.  Here any number of
+** producers and consumers can share the queue.  Each slot carries a
+** sequence number that says whose turn it is: slot i is free for the
+** producer claiming position pos when its sequence is pos, and full for
+** the consumer claiming position pos when its sequence is pos + 1.  A
+** producer or consumer claims a position by compare-and-swap on head or
+** tail, fills or empties the slot, and then bumps the slot's sequence
+** to hand it on.  (This is Dmitry Vyukov's bounded MPMC queue.)
+**
+** No system calls are made at all; mpmc_push()/mpmc_pop() spin, then
+** yield the CPU, when the queue is full or empty.
+*/
+
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define MPMC_CACHELINE 64
+#define MPMC_SPINS 200  /* spins before we yield */
+
+struct mpmc_slot {
+	_Atomic uint64_t seq;
+	unsigned char data[];
+};
+
+struct mpmc {
+	_Alignas(MPMC_CACHELINE) _Atomic uint64_t head;  /* next to push */
+	_Alignas(MPMC_CACHELINE) _Atomic uint64_t tail;  /* next to pop */
+
+	/* read-only after mpmc_init() */
+	_Alignas(MPMC_CACHELINE) uint32_t cap;
+	uint32_t mask;
+	uint32_t recsize;
+	uint32_t stride;
+	uint32_t spins;  /* MPMC_SPINS, or 1 on a uniprocessor */
+
+	_Alignas(MPMC_CACHELINE) unsigned char slots[];
+};
+
+static inline void mpmc_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline uint32_t mpmc_stride(uint32_t recsize)
+{
+	/* the sequence number, then the record, kept 8-byte aligned */
+	return sizeof(struct mpmc_slot) + ((recsize + 7) & ~7u);
+}
+
+static inline struct mpmc_slot *mpmc_slot(struct mpmc *q, uint64_t pos)
+{
+	return (struct mpmc_slot *)(q->slots + (pos & q->mask) * q->stride);
+}
+
+/*
+** mpmc_bytes() -- how much memory a queue of cap records needs
+*/
+static inline size_t mpmc_bytes(uint32_t cap, uint32_t recsize)
+{
+	return sizeof(struct mpmc) + (size_t)cap * mpmc_stride(recsize);
+}
+
+/*
+** mpmc_init() -- set up a queue in memory of at least mpmc_bytes()
+** bytes.  cap must be a power of two.  Returns -1 with errno set on
+** error.
+*/
+static inline int mpmc_init(struct mpmc *q, uint32_t cap, uint32_t recsize)
+{
+	uint32_t i;
+
+	if (cap == 0 || (cap & (cap - 1)) != 0 || recsize == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	q->cap = cap;
+	q->mask = cap - 1;
+	q->recsize = recsize;
+	q->stride = mpmc_stride(recsize);
+	q->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MPMC_SPINS : 1;
+
+	for (i = 0; i < cap; i++)
+		atomic_init(&mpmc_slot(q, i)->seq, i);
+
+	return 0;
+}
+
+/*
+** mpmc_trypush() -- copy one record in.  Returns 0, or -1 if full.
+*/
+static inline int mpmc_trypush(struct mpmc *q, const void *rec)
+{
+	uint64_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	struct mpmc_slot *s;
+
+	for (;;) {
+		int64_t diff;
+
+		s = mpmc_slot(q, pos);
+		diff = (int64_t)(atomic_load_explicit(&s->seq,
+			memory_order_acquire) - pos);
+
+		if (diff == 0) {
+			/* the slot's free; try to claim the position */
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos,
+			    pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0)
+			return -1;  /* a lap behind: full */
+		else
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	}
+
+	memcpy(s->data, rec, q->recsize);
+
+	/* release: the record is in before a consumer can see the slot full */
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+
+	return 0;
+}
+
+/*
+** mpmc_trypop() -- copy one record out.  Returns 0, or -1 if empty.
+*/
+static inline int mpmc_trypop(struct mpmc *q, void *rec)
+{
+	uint64_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	struct mpmc_slot *s;
+
+	for (;;) {
+		int64_t diff;
+
+		s = mpmc_slot(q, pos);
+		diff = (int64_t)(atomic_load_explicit(&s->seq,
+			memory_order_acquire) - (pos + 1));
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos,
+			    pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0)
+			return -1;  /* nothing pushed here yet: empty */
+		else
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	}
+
+	memcpy(rec, s->data, q->recsize);
+
+	/* hand the slot to the producer one lap ahead */
+	atomic_store_explicit(&s->seq, pos + q->cap, memory_order_release);
+
+	return 0;
+}
+
+/*
+** mpmc_push()/mpmc_pop() -- blocking versions; spin, then yield
+*/
+static inline void mpmc_push(struct mpmc *q, const void *rec)
+{
+	unsigned spins = 0;
+
+	while (mpmc_trypush(q, rec) == -1)
+		if (++spins < q->spins) mpmc_cpu_relax();
+		else sched_yield();
+}
+
+static inline void mpmc_pop(struct mpmc *q, void *rec)
+{
+	unsigned spins = 0;
+
+	while (mpmc_trypop(q, rec) == -1)
+		if (++spins < q->spins) mpmc_cpu_relax();
+		else sched_yield();
+}
+
+#endif
@@ -0,0 +1,278 @@
+/*
+** mq_depth.c -- how deep should a POSIX message queue be?
+**
+** mq_sender.c makes a queue three messages deep, so the sender stalls in
+** mq_send() as soon as the receiver falls three behind.  This one takes
+** the depth and message size as parameters, or works out the largest
+** queue the system will let it make:
+**
+**   - /proc/sys/fs/mqueue/msg_max and msgsize_max cap mq_maxmsg and
+**     mq_msgsize (unless you have CAP_SYS_RESOURCE)
+**   - RLIMIT_MSGQUEUE caps the bytes all of a user's queues can hold,
+**     for everybody (ulimit -q)
+**
+** Then it streams messages to a receiving child and reports throughput,
+** the latency of each mq_send() call, and how often and how long the
+** sender was blocked on a full queue.  -b repeats that for depths
+** 1, 2, 4, ... up to the largest that fits.
+**
+** usage: mq_depth [-d depth] [-s msgsize] [-n count] [-w ns] [-b]
+**
+** -w makes the receiver spend that many ns on each message, like a real
+** consumer would.  The queue only helps if the receiver keeps up on
+** average; depth just soaks up the bursts.
+*/
+
+#ifdef __APPLE__
+#warning "Apple doesn't support POSIX message queues."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <mqueue.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+#define BENCH_BYTES (64 * 1024 * 1024)
+#define DEFAULT_MSGMAX 10       // Linux defaults, if /proc isn't there
+#define DEFAULT_MSGSIZEMAX 8192
+
+static long msg_max, msgsize_max;
+
+struct result {
+    long depth;              // what open_largest() actually gave us
+    uint64_t elapsed_ns;
+    uint64_t blocked_ns;     // time spent in mq_send() calls that blocked
+    unsigned long stalls;    // how many of those there were
+};
+
+/**
+ * Open a fresh queue, shrinking the depth until the system agrees to it.
+ * EINVAL means over msg_max (or msgsize_max); EMFILE means over
+ * RLIMIT_MSGQUEUE.  Sets *depth to what we got.
+ */
+static mqd_t open_largest(const char *name, long *depth, long msgsize)
+{
+    for (;;) {
+        struct mq_attr attr = {
+            .mq_maxmsg = *depth,
+            .mq_msgsize = msgsize
+        };
+        mqd_t mqdes = mq_open(name, O_WRONLY | O_CREAT | O_EXCL, 0600, &attr);
+
+        if (mqdes != (mqd_t)-1)
+            return mqdes;
+
+        if ((errno != EINVAL && errno != EMFILE) || *depth == 1) {
+            perror("mq_open");
+            exit(1);
+        }
+
+        if (errno == EINVAL && *depth > msg_max)
+            *depth = msg_max;  // probably not privileged
+        else
+            *depth /= 2;
+    }
+}
+
+/**
+ * Pretend to do work on a message for ns nanoseconds.
+ */
+static void spin(uint64_t ns)
+{
+    uint64_t until = now_ns() + ns;
+
+    while (ns > 0 && now_ns() < until)
+        ;
+}
+
+/**
+ * Send count messages of msgsize bytes through a queue depth deep to a
+ * child that receives them.  Each mq_send() call's duration goes in lat.
+ * The depth may come out smaller than asked for; r.depth says what it was.
+ */
+static struct result run(long depth, long msgsize, size_t count,
+                         uint64_t work, struct lat *lat)
+{
+    char name[64];
+    char *msg = calloc(1, msgsize);
+    struct result r = {0};
+    mqd_t mq, mq_nb;
+    int status;
+    pid_t pid;
+
+    if (msg == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    snprintf(name, sizeof name, "/mq_depth_%d", (int)getpid());
+    mq = open_largest(name, &depth, msgsize);
+    r.depth = depth;
+
+    // A second, non-blocking descriptor tells us when a send would block
+    if ((mq_nb = mq_open(name, O_WRONLY | O_NONBLOCK)) == (mqd_t)-1) {
+        perror("mq_open");
+        exit(1);
+    }
+
+    r.elapsed_ns = now_ns();
+
+    switch (pid = fork()) {
+        case -1:
+            perror("fork");
+            exit(1);
+
+        case 0: {
+            mqd_t rq = mq_open(name, O_RDONLY);
+
+            if (rq == (mqd_t)-1) {
+                perror("child: mq_open");
+                _exit(1);
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (mq_receive(rq, msg, msgsize, NULL) == -1) {
+                    if (errno == EINTR) { i--; continue; }
+                    perror("mq_receive");
+                    _exit(1);
+                }
+                spin(work);
+            }
+            _exit(0);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t t0 = now_ns();
+
+        if (mq_send(mq_nb, msg, msgsize, 0) == -1) {
+            if (errno != EAGAIN) {
+                perror("mq_send");
+                exit(1);
+            }
+
+            // Queue's full: this is the stall we're here to measure
+            while (mq_send(mq, msg, msgsize, 0) == -1) {
+                if (errno != EINTR) {
+                    perror("mq_send");
+                    exit(1);
+                }
+            }
+            r.stalls++;
+            r.blocked_ns += now_ns() - t0;
+        }
+
+        lat_add(lat, now_ns() - t0);
+    }
+
+    waitpid(pid, &status, 0);
+    r.elapsed_ns = now_ns() - r.elapsed_ns;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "mq_depth: receiver failed\n");
+        exit(1);
+    }
+
+    mq_close(mq_nb);
+    mq_close(mq);
+    mq_unlink(name);
+    free(msg);
+
+    return r;
+}
+
+static void report(long depth, long msgsize, size_t count, uint64_t work)
+{
+    struct result r;
+    struct lat lat;
+    char mech[64];
+
+    lat_init(&lat, count);
+    r = run(depth, msgsize, count, work, &lat);
+
+    snprintf(mech, sizeof mech, "posix_mq_depth_%ld", r.depth);
+    bench_csv_row(mech, msgsize, count, r.elapsed_ns, &lat);
+    fflush(stdout);
+
+    fprintf(stderr, "depth %ld: %lu of %zu sends blocked, for %.1f%% of "
+            "the run\n", r.depth, r.stalls, count,
+            100.0 * r.blocked_ns / r.elapsed_ns);
+
+    lat_free(&lat);
+}
+
+int main(int argc, char *argv[])
+{
+    long depth = 0, msgsize = 0;
+    size_t count = 0;
+    uint64_t work = 0;
+    int opt, sweep = 0;
+    struct rlimit rl;
+    char name[64];
+
+    while ((opt = getopt(argc, argv, "d:s:n:w:b")) != -1) {
+        switch (opt) {
+            case 'd': depth = atol(optarg); break;
+            case 's': msgsize = atol(optarg); break;
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            case 'w': work = strtoull(optarg, NULL, 0); break;
+            case 'b': sweep = 1; break;
+            default:
+                fprintf(stderr, "usage: mq_depth [-d depth] [-s msgsize] "
+                        "[-n count] [-w ns] [-b]\n");
+                exit(1);
+        }
+    }
+
+    msg_max = read_proc_long("/proc/sys/fs/mqueue/msg_max", DEFAULT_MSGMAX);
+    msgsize_max = read_proc_long("/proc/sys/fs/mqueue/msgsize_max",
+                                 DEFAULT_MSGSIZEMAX);
+
+    if (depth < 0 || msgsize < 0) {
+        fprintf(stderr, "mq_depth: bad arguments\n");
+        exit(1);
+    }
+
+    // Unless told otherwise, ask for the biggest the limits allow
+    if (msgsize == 0) msgsize = msgsize_max;
+    if (depth == 0) depth = msg_max;
+
+    getrlimit(RLIMIT_MSGQUEUE, &rl);
+    fprintf(stderr, "msg_max %ld, msgsize_max %ld, RLIMIT_MSGQUEUE ",
+            msg_max, msgsize_max);
+    if (rl.rlim_cur == RLIM_INFINITY)
+        fprintf(stderr, "unlimited\n");
+    else
+        fprintf(stderr, "%llu bytes\n", (unsigned long long)rl.rlim_cur);
+
+    // Find out how much of that we can really have
+    snprintf(name, sizeof name, "/mq_depth_%d", (int)getpid());
+    mq_close(open_largest(name, &depth, msgsize));
+    mq_unlink(name);
+
+    fprintf(stderr, "largest queue: %ld messages of %ld bytes\n", depth,
+            msgsize);
+
+    if (count == 0)
+        count = bench_count(msgsize, BENCH_BYTES, 10000, 200000);
+
+    bench_csv_header();
+
+    if (sweep) {
+        for (long d = 1; d < depth; d *= 2)
+            report(d, msgsize, count, work);
+    }
+    report(depth, msgsize, count, work);
+
+    return 0;
+}
+
+#endif
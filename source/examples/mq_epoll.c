@@ -0,0 +1,342 @@
+/*
+** mq_epoll.c -- an mq_receiver.c that can wait on more than one thing
+**
+** On Linux an mqd_t is really a file descriptor, so it can go in an
+** epoll set right next to sockets, timers and signals.  This one event
+** loop serves any number of queues plus a datagram socket, prints stats
+** once a second from a timerfd, and stops cleanly on ^C via a signalfd.
+**
+** Every wakeup drains the ready queue with O_NONBLOCK until EAGAIN, so a
+** burst of messages costs one trip through epoll_wait() instead of one
+** each.  "-1" takes just one message per wakeup, for comparison.
+**
+** usage: mq_epoll [-1] [-l count] [queue ...]   (default /mq_test)
+**
+** -l forks a sender per queue that fires count messages as fast as it
+** can, then reports wakeups per message and exits.
+*/
+
+#ifndef __linux__
+#warning "mq_epoll needs Linux, where an mqd_t is a file descriptor."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <mqueue.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#define SOCK_PATH "mq_epoll_socket"
+#define MAX_QUEUES 64
+#define MAX_EVENTS (MAX_QUEUES + 3)
+#define LOAD_MSG_SIZE 64
+
+// What each epoll event refers to
+enum { SRC_QUEUE, SRC_SOCKET, SRC_TIMER, SRC_SIGNAL };
+
+struct source {
+    int type;
+    int fd;
+    const char *name;
+    unsigned long msgs;
+};
+
+struct stats {
+    unsigned long wakeups;   // epoll_wait() returns with a message source ready
+    unsigned long msgs;
+};
+
+static char *buf;
+static size_t bufsize;
+static int one_at_a_time, quiet;
+
+/**
+ * Open (creating if need be) a queue for non-blocking reads, and make
+ * sure our receive buffer is big enough for its messages.
+ */
+static mqd_t open_queue(const char *name)
+{
+    struct mq_attr attr;
+    mqd_t mqdes = mq_open(name, O_RDONLY | O_CREAT | O_NONBLOCK, 0644, NULL);
+
+    if (mqdes == (mqd_t)-1) {
+        perror(name);
+        exit(1);
+    }
+
+    if (mq_getattr(mqdes, &attr) == -1) {
+        perror("mq_getattr");
+        exit(1);
+    }
+
+    if ((size_t)attr.mq_msgsize > bufsize) {
+        bufsize = attr.mq_msgsize;
+        if ((buf = realloc(buf, bufsize + 1)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    return mqdes;
+}
+
+static int open_socket(void)
+{
+    struct sockaddr_un local = { .sun_family = AF_UNIX };
+    int s = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+    if (s == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    strcpy(local.sun_path, SOCK_PATH);
+    unlink(local.sun_path);
+    if (bind(s, (struct sockaddr *)&local, sizeof local) == -1) {
+        perror("bind");
+        exit(1);
+    }
+
+    return s;
+}
+
+static void watch(int epfd, struct source *src)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/**
+ * Read everything waiting on a queue or the socket (or just one
+ * message, with -1).  Returns the number of messages read.
+ */
+static unsigned long drain(struct source *src)
+{
+    unsigned long n = 0;
+
+    for (;;) {
+        unsigned int prio = 0;
+        ssize_t len;
+
+        if (src->type == SRC_QUEUE)
+            len = mq_receive(src->fd, buf, bufsize, &prio);
+        else
+            len = recv(src->fd, buf, bufsize, 0);
+
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            perror(src->name);
+            exit(1);
+        }
+
+        n++;
+
+        if (!quiet) {
+            buf[len] = '\0';
+            printf("received \"%s\" (%zd bytes) on %s at priority %u\n",
+                   buf, len, src->name, prio);
+        }
+
+        if (one_at_a_time) break;
+    }
+
+    src->msgs += n;
+
+    return n;
+}
+
+static void print_stats(const char *when, const struct stats *st)
+{
+    fprintf(stderr, "%s: %lu messages in %lu wakeups (%.3f wakeups per "
+            "message)\n", when, st->msgs, st->wakeups,
+            st->msgs ? (double)st->wakeups / st->msgs : 0.0);
+}
+
+/**
+ * The -l load: count messages, in a burst, to one queue.
+ */
+static void send_load(const char *name, unsigned long count)
+{
+    char msg[LOAD_MSG_SIZE];
+    mqd_t mqdes = mq_open(name, O_WRONLY);
+
+    if (mqdes == (mqd_t)-1) {
+        perror(name);
+        _exit(1);
+    }
+
+    for (unsigned long i = 0; i < count; i++) {
+        snprintf(msg, sizeof msg, "%s #%lu", name, i);
+        if (mq_send(mqdes, msg, sizeof msg, 0) == -1) {
+            perror("mq_send");
+            _exit(1);
+        }
+    }
+
+    mq_close(mqdes);
+    _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    static char *default_queues[] = { "/mq_test" };
+    struct source src[MAX_QUEUES + 3];
+    struct epoll_event events[MAX_EVENTS];
+    struct itimerspec tick = { { 1, 0 }, { 1, 0 } };
+    struct stats total = {0}, last = {0};
+    unsigned long load = 0, want = 0;
+    char **queues = default_queues;
+    int nqueues = 1, opt, epfd, done = 0, status, failed = 0;
+    sigset_t stop;
+
+    while ((opt = getopt(argc, argv, "1l:")) != -1) {
+        switch (opt) {
+            case '1': one_at_a_time = 1; break;
+            case 'l': load = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: mq_epoll [-1] [-l count] "
+                        "[queue ...]\n");
+                exit(1);
+        }
+    }
+
+    if (optind < argc) {
+        queues = argv + optind;
+        nqueues = argc - optind;
+    }
+    if (nqueues > MAX_QUEUES) {
+        fprintf(stderr, "mq_epoll: at most %d queues\n", MAX_QUEUES);
+        exit(1);
+    }
+
+    quiet = load > 0;
+
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    for (int i = 0; i < nqueues; i++) {
+        src[i] = (struct source){ SRC_QUEUE, open_queue(queues[i]), queues[i], 0 };
+        watch(epfd, &src[i]);
+    }
+
+    src[nqueues] = (struct source){ SRC_SOCKET, open_socket(), SOCK_PATH, 0 };
+    watch(epfd, &src[nqueues]);
+
+    // the once-a-second stats tick
+    src[nqueues + 1] = (struct source){ SRC_TIMER,
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK), "timer", 0 };
+    if (src[nqueues + 1].fd == -1 ||
+        timerfd_settime(src[nqueues + 1].fd, 0, &tick, NULL) == -1) {
+        perror("timerfd");
+        exit(1);
+    }
+    watch(epfd, &src[nqueues + 1]);
+
+    // ^C and SIGTERM arrive as readable events instead of interrupting us
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop, NULL);
+    src[nqueues + 2] = (struct source){ SRC_SIGNAL,
+        signalfd(-1, &stop, SFD_NONBLOCK), "signal", 0 };
+    if (src[nqueues + 2].fd == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+    watch(epfd, &src[nqueues + 2]);
+
+    if (load > 0) {
+        want = load * nqueues;
+        for (int i = 0; i < nqueues; i++) {
+            switch (fork()) {
+                case -1:
+                    perror("fork");
+                    exit(1);
+
+                case 0:
+                    send_load(queues[i], load);
+            }
+        }
+    } else {
+        printf("Waiting on %d queue%s and %s...\n", nqueues,
+               nqueues == 1 ? "" : "s", SOCK_PATH);
+        fflush(stdout);
+    }
+
+    while (!done) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        int got_msgs = 0;
+
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct source *s = events[i].data.ptr;
+            struct signalfd_siginfo si;
+            uint64_t ticks;
+
+            switch (s->type) {
+                case SRC_QUEUE:
+                case SRC_SOCKET:
+                    total.msgs += drain(s);
+                    got_msgs = 1;
+                    break;
+
+                case SRC_TIMER:
+                    if (read(s->fd, &ticks, sizeof ticks) == sizeof ticks &&
+                        total.msgs != last.msgs) {
+                        struct stats d = { total.wakeups - last.wakeups,
+                                           total.msgs - last.msgs };
+                        print_stats("last second", &d);
+                        last = total;
+                    }
+                    break;
+
+                case SRC_SIGNAL:
+                    if (read(s->fd, &si, sizeof si) == sizeof si) done = 1;
+                    break;
+            }
+        }
+
+        total.wakeups += got_msgs;
+
+        if (want > 0 && total.msgs >= want) done = 1;
+    }
+
+    if (load > 0)
+        while (wait(&status) != -1)
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+
+    for (int i = 0; i <= nqueues; i++)
+        fprintf(stderr, "%s: %lu messages\n", src[i].name, src[i].msgs);
+    print_stats("total", &total);
+
+    for (int i = 0; i < nqueues; i++)
+        mq_close(src[i].fd);
+    unlink(SOCK_PATH);
+
+    return failed;
+}
+
+#endif
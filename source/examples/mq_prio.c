@@ -0,0 +1,328 @@
+/*
+** mq_prio.c -- what message priorities buy you under load
+**
+** A child floods /mq_test with a mix of priorities while we receive.
+** mq_receive() always hands out the oldest message of the highest
+** priority waiting, so the high priorities sail through and the low
+** ones wait.  Each message carries its send time, and for every
+** priority we keep:
+**
+**   - a latency histogram (send to receive)
+**   - starvation time: stretches where that priority had a message
+**     waiting but none of its messages came out of the queue
+**
+** usage: mq_prio [-m prio:weight,...] [-n count] [-w ns]
+**
+** The default mix, "0:90,16:9,31:1", is mostly bulk traffic at 0 with
+** a few control messages at 31.  -w makes us spend that many ns on each
+** message, so the queue backs up like it would behind a busy consumer.
+*/
+
+#ifdef __APPLE__
+#warning "Apple doesn't support POSIX message queues."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <mqueue.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define QUEUE_NAME "/mq_test"
+#define DEFAULT_MIX "0:90,16:9,31:1"
+#define DEFAULT_COUNT 100000
+#define MAX_LEVELS 16
+#define HIST_BUCKETS 32   // powers of two, in microseconds
+#define HIST_WIDTH 40
+
+struct prio_msg {
+    uint64_t sent_ns;
+    unsigned int prio;
+    char pad[52];         // make it a 64-byte message
+};
+
+struct level {
+    unsigned int prio;
+    unsigned int weight;
+    unsigned long hist[HIST_BUCKETS];
+    uint64_t last_ns;         // when we last got one of these
+    uint64_t starved_ns;      // total time starved
+    uint64_t max_starved_ns;  // longest single stretch
+    struct lat lat;
+};
+
+static struct level levels[MAX_LEVELS];
+static int nlevels;
+
+/**
+ * Parse "prio:weight,prio:weight,..." into levels[].
+ */
+static void parse_mix(char *mix)
+{
+    long prio_max = sysconf(_SC_MQ_PRIO_MAX);
+
+    for (char *tok = strtok(mix, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        unsigned int prio, weight;
+
+        if (nlevels == MAX_LEVELS ||
+            sscanf(tok, "%u:%u", &prio, &weight) != 2 ||
+            (prio_max > 0 && prio >= prio_max) || weight == 0) {
+            fprintf(stderr, "mq_prio: bad mix entry \"%s\"\n", tok);
+            exit(1);
+        }
+
+        levels[nlevels].prio = prio;
+        levels[nlevels].weight = weight;
+        nlevels++;
+    }
+
+    if (nlevels == 0) {
+        fprintf(stderr, "mq_prio: empty mix\n");
+        exit(1);
+    }
+}
+
+static struct level *find_level(unsigned int prio)
+{
+    for (int i = 0; i < nlevels; i++)
+        if (levels[i].prio == prio)
+            return &levels[i];
+
+    return NULL;
+}
+
+/**
+ * The flood: count messages, priorities picked at random by weight.
+ */
+static void flood(size_t count)
+{
+    mqd_t mqdes = mq_open(QUEUE_NAME, O_WRONLY);
+    unsigned int total = 0, seed = getpid();
+    struct prio_msg msg;
+
+    if (mqdes == (mqd_t)-1) {
+        perror("child: mq_open");
+        _exit(1);
+    }
+
+    for (int i = 0; i < nlevels; i++)
+        total += levels[i].weight;
+
+    memset(&msg, 0, sizeof msg);
+
+    for (size_t n = 0; n < count; n++) {
+        unsigned int r = rand_r(&seed) % total;
+        int i = 0;
+
+        while (r >= levels[i].weight)
+            r -= levels[i++].weight;
+
+        msg.prio = levels[i].prio;
+        msg.sent_ns = now_ns();
+
+        if (mq_send(mqdes, (char *)&msg, sizeof msg, msg.prio) == -1) {
+            if (errno == EINTR) { n--; continue; }
+            perror("mq_send");
+            _exit(1);
+        }
+    }
+
+    mq_close(mqdes);
+    _exit(0);
+}
+
+/**
+ * Account for one message of level l, received at now_ns.
+ *
+ * If it was sent before we last served this level, it has been waiting
+ * that whole time, so everything since then counts as starvation.
+ * Otherwise it's only been starving since it was sent.
+ */
+static void record(struct level *l, uint64_t sent, uint64_t now)
+{
+    uint64_t lat = now - sent;
+    uint64_t from = sent > l->last_ns ? sent : l->last_ns;
+    uint64_t starved = now - from;
+    int b = 0;
+
+    lat_add(&l->lat, lat);
+
+    for (uint64_t us = lat / 1000; us > 0 && b < HIST_BUCKETS - 1; us >>= 1)
+        b++;
+    l->hist[b]++;
+
+    l->starved_ns += starved;
+    if (starved > l->max_starved_ns)
+        l->max_starved_ns = starved;
+
+    l->last_ns = now;
+}
+
+static void print_histogram(const struct level *l, uint64_t elapsed)
+{
+    unsigned long most = 0;
+    int lo = HIST_BUCKETS, hi = -1;
+
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (l->hist[b] > most) most = l->hist[b];
+        if (l->hist[b] > 0) {
+            if (b < lo) lo = b;
+            hi = b;
+        }
+    }
+
+    fprintf(stderr, "priority %u: %zu messages, starved %.1f%% of the run, "
+            "longest %.1f us\n", l->prio, l->lat.n,
+            elapsed ? 100.0 * l->starved_ns / elapsed : 0.0,
+            l->max_starved_ns / 1000.0);
+
+    for (int b = lo; b <= hi; b++) {
+        int bar = (int)(l->hist[b] * HIST_WIDTH / most);
+
+        fprintf(stderr, "  < %8lu us %-*.*s %lu\n", 1ul << b, HIST_WIDTH,
+                bar, "########################################", l->hist[b]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char mix[256] = DEFAULT_MIX;
+    size_t count = DEFAULT_COUNT, received = 0;
+    uint64_t work = 0, start, elapsed;
+    struct mq_attr attr;
+    int opt, status;
+    char *buf;
+    mqd_t mqdes;
+
+    while ((opt = getopt(argc, argv, "m:n:w:")) != -1) {
+        switch (opt) {
+            case 'm':
+                snprintf(mix, sizeof mix, "%s", optarg);
+                break;
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            case 'w': work = strtoull(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: mq_prio [-m prio:weight,...] "
+                        "[-n count] [-w ns]\n");
+                exit(1);
+        }
+    }
+
+    parse_mix(mix);
+
+    mqdes = mq_open(QUEUE_NAME, O_RDONLY | O_CREAT | O_NONBLOCK, 0644, NULL);
+    if (mqdes == (mqd_t)-1) {
+        perror("mq_open");
+        exit(1);
+    }
+
+    if (mq_getattr(mqdes, &attr) == -1) {
+        perror("mq_getattr");
+        exit(1);
+    }
+    if (attr.mq_msgsize < (long)sizeof(struct prio_msg)) {
+        fprintf(stderr, "mq_prio: %s only takes %ld-byte messages; "
+                "run mq_unlink first\n", QUEUE_NAME, attr.mq_msgsize);
+        exit(1);
+    }
+    if ((buf = malloc(attr.mq_msgsize)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Throw out anything left over from mq_sender, then block from here on
+    while (mq_receive(mqdes, buf, attr.mq_msgsize, NULL) != -1)
+        ;
+    attr.mq_flags = 0;
+    mq_setattr(mqdes, &attr, NULL);
+
+    for (int i = 0; i < nlevels; i++)
+        lat_init(&levels[i].lat, count);
+
+    fprintf(stderr, "flooding %s (depth %ld) with %zu messages\n",
+            QUEUE_NAME, attr.mq_maxmsg, count);
+
+    start = now_ns();
+    for (int i = 0; i < nlevels; i++)
+        levels[i].last_ns = start;
+
+    switch (fork()) {
+        case -1:
+            perror("fork");
+            exit(1);
+
+        case 0:
+            flood(count);
+    }
+
+    while (received < count) {
+        unsigned int prio;
+        ssize_t len = mq_receive(mqdes, buf, attr.mq_msgsize, &prio);
+        struct prio_msg msg;
+        struct level *l;
+
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            perror("mq_receive");
+            exit(1);
+        }
+        if (len != sizeof msg || (l = find_level(prio)) == NULL)
+            continue;  // somebody else's message
+
+        memcpy(&msg, buf, sizeof msg);
+        record(l, msg.sent_ns, now_ns());
+        received++;
+
+        if (work > 0) {
+            uint64_t until = now_ns() + work;
+
+            while (now_ns() < until)
+                ;
+        }
+    }
+
+    elapsed = now_ns() - start;
+
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "mq_prio: sender failed\n");
+        exit(1);
+    }
+
+    bench_csv_header();
+
+    // Highest priority first
+    for (int i = 0; i < nlevels; i++) {
+        for (int j = i + 1; j < nlevels; j++) {
+            if (levels[j].prio > levels[i].prio) {
+                struct level t = levels[i];
+                levels[i] = levels[j];
+                levels[j] = t;
+            }
+        }
+    }
+
+    for (int i = 0; i < nlevels; i++) {
+        char mech[64];
+
+        snprintf(mech, sizeof mech, "posix_mq_prio_%u", levels[i].prio);
+        bench_csv_row(mech, sizeof(struct prio_msg), levels[i].lat.n,
+                      elapsed, &levels[i].lat);
+        print_histogram(&levels[i], elapsed);
+        lat_free(&levels[i].lat);
+    }
+
+    mq_close(mqdes);
+    free(buf);
+
+    return 0;
+}
+
+#endif
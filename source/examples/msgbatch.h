@@ -0,0 +1,152 @@
+/*
+** msgbatch.h -- packs many small records into one System V message so
+** a whole batch costs a single msgsnd()/msgrcv()
+**
+** Each record in a batch's mtext is a 2-byte length followed by that
+** many bytes.  Batches go out with mtype BATCH_MTYPE so a receiver can
+** tell them apart from kirk.c's plain one-line messages (mtype 1).
+*/
+
+#ifndef MSGBATCH_H
+#define MSGBATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#include "bench.h"
+
+#define BATCH_MTYPE 2
+#define BATCH_HDR sizeof(uint16_t)
+
+struct batch_msgbuf {
+	long mtype;
+	char mtext[];
+};
+
+struct batch {
+	int msqid;
+	size_t max;          /* most mtext bytes we'll send in one message */
+	size_t len;          /* mtext bytes packed so far */
+	size_t nrec;         /* records packed so far */
+	uint64_t first_ns;   /* when the oldest unsent record went in */
+	struct batch_msgbuf *msg;
+};
+
+/*
+** batch_msgmax() -- the largest message this queue will take: the
+** system's msgmax, but no more than the queue's byte limit
+*/
+static inline size_t batch_msgmax(int msqid)
+{
+	struct msqid_ds ds;
+	long max = read_proc_long("/proc/sys/kernel/msgmax", 8192);
+
+	if (msgctl(msqid, IPC_STAT, &ds) == 0 && ds.msg_qbytes < (size_t)max)
+		max = ds.msg_qbytes;
+
+	return max;
+}
+
+/*
+** batch_init() -- get ready to send batches on msqid.  Returns -1 with
+** errno set on error.
+*/
+static inline int batch_init(struct batch *b, int msqid)
+{
+	b->msqid = msqid;
+	b->max = batch_msgmax(msqid);
+	b->len = b->nrec = 0;
+	b->first_ns = 0;
+
+	if ((b->msg = malloc(sizeof *b->msg + b->max)) == NULL) return -1;
+	b->msg->mtype = BATCH_MTYPE;
+
+	return 0;
+}
+
+static inline void batch_free(struct batch *b)
+{
+	free(b->msg);
+	b->msg = NULL;
+}
+
+/*
+** batch_flush() -- send whatever's packed, if anything
+*/
+static inline int batch_flush(struct batch *b)
+{
+	if (b->len == 0) return 0;
+
+	while (msgsnd(b->msqid, b->msg, b->len, 0) == -1)
+		if (errno != EINTR) return -1;
+
+	b->len = b->nrec = 0;
+
+	return 0;
+}
+
+/*
+** batch_add() -- pack one record, sending the batch first if the
+** record won't fit.  Returns -1 with errno set on error (EMSGSIZE if
+** the record could never fit in a message).
+*/
+static inline int batch_add(struct batch *b, const void *rec, size_t len)
+{
+	uint16_t hdr = len;
+
+	if (len > UINT16_MAX || BATCH_HDR + len > b->max) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (b->len + BATCH_HDR + len > b->max && batch_flush(b) == -1)
+		return -1;
+
+	if (b->nrec == 0) b->first_ns = now_ns();
+
+	memcpy(b->msg->mtext + b->len, &hdr, BATCH_HDR);
+	memcpy(b->msg->mtext + b->len + BATCH_HDR, rec, len);
+	b->len += BATCH_HDR + len;
+	b->nrec++;
+
+	return 0;
+}
+
+/*
+** batch_overdue() -- true if the oldest unsent record has waited at
+** least timeout_ns.  Senders call this to keep latency bounded when
+** records trickle in too slowly to fill a batch.
+*/
+static inline int batch_overdue(const struct batch *b, uint64_t timeout_ns)
+{
+	return b->nrec > 0 && now_ns() - b->first_ns >= timeout_ns;
+}
+
+/*
+** batch_next() -- step through the records in a received batch.  Start
+** with *off = 0.  Returns a pointer to the next record and sets *len,
+** or returns NULL when there are no more (or the framing is bad).
+*/
+static inline const char *batch_next(const char *mtext, size_t mlen,
+	size_t *off, size_t *len)
+{
+	uint16_t hdr;
+
+	if (*off + BATCH_HDR > mlen) return NULL;
+
+	memcpy(&hdr, mtext + *off, BATCH_HDR);
+	if (*off + BATCH_HDR + hdr > mlen) return NULL;
+
+	*len = hdr;
+	*off += BATCH_HDR + hdr;
+
+	return mtext + *off - hdr;
+}
+
+#endif
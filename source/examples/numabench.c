@@ -0,0 +1,192 @@
+/*
+** numabench.c -- ring.h ping-pong between two processes, with the
+** shared segment and each process placed on chosen NUMA nodes (see
+** seg.h)
+**
+** The producer pushes a record into one ring, the consumer pops it and
+** pushes it back on another, and we time the round trip.  Every round
+** trip drags the rings' cache lines between the two processes, and from
+** memory if they've fallen out of cache, so where both the processes
+** and the memory are matters.
+**
+** By default it runs three placements:
+**
+**   local        segment, producer and consumer all on node 0
+**   remote_mem   both processes on node 0, segment on node 1
+**   split        producer on node 0, consumer and segment on node 1
+**
+** skipping those that need a node the machine doesn't have.  Or pick
+** one yourself with -m (segment), -p (producer) and -c (consumer).
+** -s uses a SysV segment (as in shmdemo.c) instead of an anonymous one
+** (as in mmap_anon.c).  Prints CSV (see bench.h).
+**
+** usage: numabench [-n round_trips] [-s] [-m node -p node -c node]
+*/
+
+#ifndef __linux__
+#warning "numabench needs Linux NUMA system calls."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "ring.h"
+#include "seg.h"
+
+#define REC_SIZE 64
+#define RING_CAP 64
+#define DEFAULT_TRIPS 200000
+
+struct placement {
+	const char *name;
+	int mem, prod, cons;
+};
+
+static const struct placement defaults[] = {
+	{ "local", 0, 0, 0 },
+	{ "remote_mem", 1, 0, 0 },
+	{ "split", 1, 0, 1 },
+};
+
+struct rec {
+	uint64_t sent_ns;
+	char pad[REC_SIZE - sizeof(uint64_t)];
+};
+
+static void run(const struct placement *pl, int type, size_t trips)
+{
+	size_t rbytes = ring_bytes(RING_CAP, REC_SIZE);
+	struct ring *ping, *pong;
+	struct rec rec;
+	struct lat lat;
+	struct seg s;
+	uint64_t t0;
+	char mech[64];
+	int status, node;
+	size_t i;
+	pid_t pid;
+
+	if (!seg_node_online(pl->mem) || !seg_node_online(pl->prod) ||
+	    !seg_node_online(pl->cons)) {
+		fprintf(stderr, "%s: skipped (needs node %d)\n", pl->name,
+			!seg_node_online(pl->mem) ? pl->mem :
+			!seg_node_online(pl->prod) ? pl->prod : pl->cons);
+		return;
+	}
+
+	if (seg_create(&s, type, 2 * rbytes, SEG_PAGE_NORMAL, IPC_PRIVATE,
+	    NULL) == -1) {
+		perror("seg_create");
+		exit(1);
+	}
+
+	/* bind before anyone touches a page, or first touch decides */
+	if (seg_bind(&s, pl->mem) == -1) {
+		perror("mbind");
+		exit(1);
+	}
+
+	ping = s.addr;
+	pong = (struct ring *)((char *)s.addr + rbytes);
+	ring_init(ping, RING_CAP, REC_SIZE);
+	ring_init(pong, RING_CAP, REC_SIZE);
+
+	if ((node = seg_node_of(s.addr)) != pl->mem)
+		fprintf(stderr, "%s: segment landed on node %d, not %d\n",
+			pl->name, node, pl->mem);
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			if (seg_pin(0, pl->cons) == -1) {
+				perror("child: seg_pin");
+				_exit(1);
+			}
+			for (i = 0; i < trips; i++) {
+				ring_pop(ping, &rec);
+				ring_push(pong, &rec);
+			}
+			_exit(0);
+	}
+
+	if (seg_pin(0, pl->prod) == -1) {
+		perror("seg_pin");
+		exit(1);
+	}
+
+	memset(&rec, 0, sizeof rec);
+	lat_init(&lat, trips);
+
+	t0 = now_ns();
+	for (i = 0; i < trips; i++) {
+		rec.sent_ns = now_ns();
+		ring_push(ping, &rec);
+		ring_pop(pong, &rec);
+		lat_add(&lat, now_ns() - rec.sent_ns);
+	}
+	t0 = now_ns() - t0;
+
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "numabench: consumer failed\n");
+		exit(1);
+	}
+
+	snprintf(mech, sizeof mech, "%s_%s_m%d_p%d_c%d", seg_type_name[type],
+		pl->name, pl->mem, pl->prod, pl->cons);
+	bench_csv_row(mech, REC_SIZE, trips, t0, &lat);
+	fflush(stdout);
+
+	lat_free(&lat);
+	seg_destroy(&s);
+}
+
+int main(int argc, char *argv[])
+{
+	struct placement custom = { "custom", -1, -1, -1 };
+	size_t trips = DEFAULT_TRIPS, i;
+	int opt, type = SEG_ANON;
+
+	while ((opt = getopt(argc, argv, "n:sm:p:c:")) != -1) {
+		switch (opt) {
+			case 'n': trips = strtoul(optarg, NULL, 0); break;
+			case 's': type = SEG_SYSV; break;
+			case 'm': custom.mem = atoi(optarg); break;
+			case 'p': custom.prod = atoi(optarg); break;
+			case 'c': custom.cons = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: numabench [-n round_trips] [-s] "
+					"[-m node -p node -c node]\n");
+				exit(1);
+		}
+	}
+
+	if ((custom.mem != -1 || custom.prod != -1 || custom.cons != -1) &&
+	    (custom.mem == -1 || custom.prod == -1 || custom.cons == -1)) {
+		fprintf(stderr, "numabench: -m, -p and -c go together\n");
+		exit(1);
+	}
+
+	bench_csv_header();
+	fflush(stdout);
+
+	if (custom.mem != -1)
+		run(&custom, type, trips);
+	else
+		for (i = 0; i < sizeof defaults / sizeof defaults[0]; i++)
+			run(&defaults[i], type, trips);
+
+	return 0;
+}
+
+#endif
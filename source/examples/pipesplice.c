@@ -0,0 +1,287 @@
+/*
+** pipesplice.c -- streams bulk data through a pipe without copying it
+**
+** The parent gifts its buffer's pages to the pipe with vmsplice() and
+** the child moves them on to the output with splice(), so the bytes
+** never pass through a user-space buffer on the way.  Compare pipe2.c,
+** where every byte is copied into the pipe by write() and back out by
+** read().
+**
+** usage: pipesplice [-c] [-o outfile] [-p pipesize] [-s size] [-n count]
+**        pipesplice -b [-o outfile] [-p pipesize]   (benchmark; CSV)
+**
+** -c uses plain read()/write() instead, for comparison.  With no -o,
+** the child's output is another pipe, drained by a reader process that
+** read()s every byte, so the data really arrives somewhere in user
+** space either way.  With -o it goes to outfile, which may be a sink
+** like /dev/null that throws it away for free.  The benchmark's CSV
+** mechanism names end in _reader or _file to say which.
+*/
+
+#ifndef __linux__
+#warning "pipesplice needs Linux splice()."
+int main(void) {}
+#else
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define DEFAULT_PIPESIZE (1024 * 1024)
+#define DEFAULT_SIZE (16 * 1024 * 1024)
+#define DEFAULT_COUNT 16
+#define COPY_BUFSIZE (64 * 1024)   /* the consumer's read() buffer */
+
+#define BENCH_MIN (64 * 1024)
+#define BENCH_MAX (16 * 1024 * 1024)
+#define BENCH_BYTES (512 * 1024 * 1024)
+
+static const char *outname;  /* NULL: a pipe to a reader process */
+static int pipesize = DEFAULT_PIPESIZE;
+
+/*
+** produce() -- push count transfers of size bytes from buf into fd
+*/
+static void produce(int fd, const char *buf, size_t size, size_t count,
+	int copy)
+{
+	size_t i, off;
+
+	for (i = 0; i < count; i++) {
+		for (off = 0; off < size; ) {
+			ssize_t n;
+
+			if (copy) {
+				n = write(fd, buf + off, size - off);
+			} else {
+				/*
+				** Gifted pages belong to the pipe until the reader is
+				** done with them, so we must never write to buf again.
+				** We don't: it's filled once and only ever re-sent.
+				*/
+				struct iovec iov = {
+					.iov_base = (void *)(buf + off),
+					.iov_len = size - off,
+				};
+				n = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+			}
+
+			if (n == -1) {
+				if (errno == EINTR) continue;
+				perror(copy ? "write" : "vmsplice");
+				exit(1);
+			}
+			off += n;
+		}
+	}
+}
+
+/*
+** consume() -- move total bytes from the pipe to outfd
+*/
+static void consume(int fd, int outfd, size_t total, int copy)
+{
+	static char buf[COPY_BUFSIZE];
+	size_t moved = 0;
+
+	while (moved < total) {
+		ssize_t n;
+
+		if (copy) {
+			if ((n = read(fd, buf, sizeof buf)) > 0 &&
+			    writen(outfd, buf, n) == -1) {
+				perror("child: write");
+				_exit(1);
+			}
+		} else
+			n = splice(fd, NULL, outfd, NULL, total - moved,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			perror(copy ? "child: read" : "child: splice");
+			_exit(1);
+		}
+		if (n == 0) {
+			fprintf(stderr, "child: early EOF\n");
+			_exit(1);
+		}
+		moved += n;
+	}
+}
+
+/*
+** reader() -- fork a process that read()s the other end of a new pipe
+** until EOF.  Returns the pipe's write end for the consumer to output
+** to, and the reader's pid in *pid.
+*/
+static int reader(pid_t *pid)
+{
+	static char buf[COPY_BUFSIZE];
+	int sink[2];
+	ssize_t n;
+
+	if (pipe(sink) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	if (fcntl(sink[1], F_SETPIPE_SZ, pipesize) == -1)
+		perror("fcntl(F_SETPIPE_SZ)");
+
+	switch (*pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			close(sink[1]);
+			while ((n = read(sink[0], buf, sizeof buf)) != 0)
+				if (n == -1 && errno != EINTR) {
+					perror("reader: read");
+					_exit(1);
+				}
+			_exit(0);
+	}
+
+	close(sink[0]);
+
+	return sink[1];
+}
+
+/*
+** stream() -- one producer, one consumer, count transfers of size
+** bytes.  Returns elapsed ns.
+*/
+static uint64_t stream(const char *buf, size_t size, size_t count, int copy)
+{
+	int pfds[2], outfd, status, rstatus = 0;
+	pid_t pid, rpid = -1;
+	uint64_t t0;
+
+	if (pipe(pfds) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+
+	/* a bigger pipe means fewer trips through the scheduler */
+	if (fcntl(pfds[1], F_SETPIPE_SZ, pipesize) == -1)
+		perror("fcntl(F_SETPIPE_SZ)");
+
+	if (outname == NULL)
+		outfd = reader(&rpid);
+	else if ((outfd = open(outname, O_WRONLY | O_CREAT | O_TRUNC,
+	    0644)) == -1) {
+		perror(outname);
+		exit(1);
+	}
+
+	t0 = now_ns();
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			close(pfds[1]);
+			consume(pfds[0], outfd, size * count, copy);
+			_exit(0);
+
+		default:
+			close(pfds[0]);
+			produce(pfds[1], buf, size, count, copy);
+			close(pfds[1]);
+			waitpid(pid, &status, 0);
+			break;
+	}
+
+	close(outfd);  /* the reader sees EOF once the child's done too */
+	if (rpid != -1) waitpid(rpid, &rstatus, 0);
+
+	t0 = now_ns() - t0;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    !WIFEXITED(rstatus) || WEXITSTATUS(rstatus) != 0) {
+		fprintf(stderr, "pipesplice: child failed\n");
+		exit(1);
+	}
+
+	return t0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = DEFAULT_SIZE, count = DEFAULT_COUNT, bufsize;
+	int opt, copy = 0, bench = 0;
+	void *buf;
+
+	while ((opt = getopt(argc, argv, "bco:p:s:n:")) != -1) {
+		switch (opt) {
+			case 'b': bench = 1; break;
+			case 'c': copy = 1; break;
+			case 'o': outname = optarg; break;
+			case 'p': pipesize = atoi(optarg); break;
+			case 's': size = strtoul(optarg, NULL, 0); break;
+			case 'n': count = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: pipesplice [-c] [-o outfile] "
+					"[-p pipesize] [-s size] [-n count] | pipesplice -b\n");
+				exit(1);
+		}
+	}
+
+	bufsize = bench ? BENCH_MAX : size;
+	if (bufsize == 0) {
+		fprintf(stderr, "pipesplice: size must be positive\n");
+		exit(1);
+	}
+
+	/* vmsplice() gifts whole pages, so the buffer must be page-aligned */
+	if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), bufsize) != 0) {
+		fprintf(stderr, "pipesplice: out of memory\n");
+		exit(1);
+	}
+	memset(buf, 'x', bufsize);
+
+	if (bench) {
+		const char *sink = outname == NULL ? "reader" : "file";
+		char copy_name[32], splice_name[32];
+
+		snprintf(copy_name, sizeof copy_name, "pipe_copy_%s", sink);
+		snprintf(splice_name, sizeof splice_name, "pipe_splice_%s", sink);
+
+		bench_csv_header();
+		fflush(stdout);
+
+		for (size = BENCH_MIN; size <= BENCH_MAX; size *= 4) {
+			count = bench_count(size, BENCH_BYTES, 4, 10000);
+
+			bench_csv_row(copy_name, size, count,
+				stream(buf, size, count, 1), NULL);
+			bench_csv_row(splice_name, size, count,
+				stream(buf, size, count, 0), NULL);
+		}
+	} else {
+		uint64_t ns = stream(buf, size, count, copy);
+
+		printf("%s: moved %zu x %zu bytes to %s in %.3f s (%.1f MB/s)\n",
+			copy ? "read/write" : "vmsplice/splice", count, size,
+			outname == NULL ? "a reader" : outname,
+			ns / 1e9, (double)size * count / (ns / 1e9) / 1e6);
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,288 @@
+/*
+** prefault.c -- the first touch of a mapped page costs a page fault;
+** here's how to pay for them all up front
+**
+** mmapdemo.c maps a file and mmap_anon.c maps anonymous memory, and in
+** both the kernel doesn't set up a page until someone touches it.  A
+** file page may have to be read from disk, too.  Those first touches
+** are the p99 spikes in a latency-sensitive loop.  The warm-up modes:
+**
+**   none      what the examples do
+**   populate  mmap() with MAP_POPULATE: fault everything in right away
+**   willneed  madvise(MADV_WILLNEED): start reading the file in, but
+**             don't set up the pages (does nothing for anonymous memory)
+**   mlock     mlock() the mapping: fault it in and keep it in RAM
+**   mlockall  mlockall(MCL_CURRENT|MCL_FUTURE) first, so every mapping
+**             we make from then on is faulted in and locked
+**
+** For each mapping and mode we time setup, then touch every page twice
+** and time each touch.  The two latency histograms, first touch and
+** steady state, go to stderr and their percentiles to CSV (see bench.h).
+** The file is dropped from the page cache before each run, so its first
+** touches may have to wait for the disk.
+**
+** usage: prefault [-m MiB] [-f file]
+**
+** The file mapping uses a scratch file, made at the start and removed at
+** the end: prefault.dat, or the -f file, to put it on another
+** filesystem.  A -f file that already exists is refused, not clobbered.
+**
+** Locking needs enough "ulimit -l" (RLIMIT_MEMLOCK); modes that fail
+** are skipped.
+*/
+
+#ifndef __linux__
+#warning "prefault needs Linux MAP_POPULATE."
+int main(void) {}
+#else
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+#define DEFAULT_MIB 64
+#define DEFAULT_FILE "prefault.dat"
+#define HIST_BUCKETS 24  /* powers of two, in ns: 1ns .. 8ms */
+#define HIST_WIDTH 25
+
+enum { WARM_NONE, WARM_POPULATE, WARM_WILLNEED, WARM_MLOCK, WARM_MLOCKALL,
+	NMODES };
+
+static const char *mode_names[] = {
+	"none", "populate", "willneed", "mlock", "mlockall"
+};
+
+struct pass {
+	struct lat lat;
+	uint64_t ns;   /* the whole pass */
+	unsigned long hist[HIST_BUCKETS];
+	long minflt, majflt;
+};
+
+static size_t pagesize;
+
+/*
+** make_file() -- a file of size bytes for the file mapping.  Only our
+** own scratch file may be there already.
+*/
+static int make_file(const char *path, size_t size, int scratch)
+{
+	char buf[65536];
+	size_t done;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | (scratch ? O_TRUNC : O_EXCL),
+	    0644)) == -1) {
+		perror(path);
+		exit(1);
+	}
+
+	memset(buf, 'x', sizeof buf);
+	for (done = 0; done < size; done += sizeof buf)
+		if (writen(fd, buf, sizeof buf) == -1) {
+			perror("write");
+			exit(1);
+		}
+
+	fsync(fd);  /* or the pages are dirty and fadvise can't drop them */
+
+	return fd;
+}
+
+/*
+** touch() -- one pass over the mapping, a page at a time, timing each
+** access.  File pages are read, as in mmapdemo.c; anonymous pages are
+** written, as in mmap_anon.c.
+*/
+static void touch(volatile char *p, size_t size, int write, struct pass *ps)
+{
+	struct rusage r0, r1;
+	size_t off;
+
+	getrusage(RUSAGE_SELF, &r0);
+	ps->ns = now_ns();
+
+	for (off = 0; off < size; off += pagesize) {
+		uint64_t t0 = now_ns(), ns;
+		int b = 0;
+
+		if (write) p[off] = 1;
+		else (void)p[off];
+
+		ns = now_ns() - t0;
+		lat_add(&ps->lat, ns);
+
+		while (ns > 1 && b < HIST_BUCKETS - 1) {
+			ns >>= 1;
+			b++;
+		}
+		ps->hist[b]++;
+	}
+
+	ps->ns = now_ns() - ps->ns;
+	getrusage(RUSAGE_SELF, &r1);
+	ps->minflt = r1.ru_minflt - r0.ru_minflt;
+	ps->majflt = r1.ru_majflt - r0.ru_majflt;
+}
+
+/*
+** print_hists() -- first touch and steady state, side by side
+*/
+static void print_hists(const struct pass *first, const struct pass *steady)
+{
+	static const char bars[] = "##########################################";
+	unsigned long most = 1;
+	int b, lo = HIST_BUCKETS, hi = 0;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		unsigned long n = first->hist[b] > steady->hist[b] ?
+			first->hist[b] : steady->hist[b];
+
+		if (n > most) most = n;
+		if (n > 0) {
+			if (b < lo) lo = b;
+			hi = b;
+		}
+	}
+
+	fprintf(stderr, "  %-12s %-*s %s\n", "", HIST_WIDTH + 9, "first touch",
+		"steady state");
+
+	for (b = lo; b <= hi; b++) {
+		int f = first->hist[b] * HIST_WIDTH / most;
+		int s = steady->hist[b] * HIST_WIDTH / most;
+
+		fprintf(stderr, "  < %8lu ns %-*.*s %8lu %-*.*s %8lu\n", 2ul << b,
+			HIST_WIDTH, f, bars, first->hist[b],
+			HIST_WIDTH, s, bars, steady->hist[b]);
+	}
+}
+
+static void run(const char *path, size_t size, int anon, int mode)
+{
+	struct pass first, steady;
+	int flags = MAP_SHARED, fd = -1;
+	uint64_t setup;
+	char *p, mech[64];
+
+	memset(&first, 0, sizeof first);
+	memset(&steady, 0, sizeof steady);
+
+	if (anon) {
+		flags |= MAP_ANONYMOUS;
+	} else {
+		if ((fd = open(path, O_RDONLY)) == -1) {
+			perror(path);
+			exit(1);
+		}
+		/* start cold: throw the file's pages out of the page cache */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	if (mode == WARM_POPULATE) flags |= MAP_POPULATE;
+
+	setup = now_ns();
+
+	if (mode == WARM_MLOCKALL && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		fprintf(stderr, "%s %s: skipped (mlockall: %s)\n",
+			anon ? "anon" : "file", mode_names[mode], strerror(errno));
+		if (fd != -1) close(fd);
+		return;
+	}
+
+	p = mmap(NULL, size, anon ? PROT_READ|PROT_WRITE : PROT_READ, flags,
+		fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	if (mode == WARM_WILLNEED) madvise(p, size, MADV_WILLNEED);
+
+	if (mode == WARM_MLOCK && mlock(p, size) == -1) {
+		fprintf(stderr, "%s %s: skipped (mlock: %s)\n",
+			anon ? "anon" : "file", mode_names[mode], strerror(errno));
+		munmap(p, size);
+		if (fd != -1) close(fd);
+		return;
+	}
+
+	setup = now_ns() - setup;
+
+	lat_init(&first.lat, size / pagesize);
+	lat_init(&steady.lat, size / pagesize);
+
+	touch(p, size, anon, &first);
+	touch(p, size, anon, &steady);
+
+	if (mode == WARM_MLOCKALL) munlockall();
+	munmap(p, size);
+	if (fd != -1) close(fd);
+
+	fprintf(stderr, "%s %s: setup %.2f ms, first pass %ld minor and %ld "
+		"major faults\n", anon ? "anon" : "file", mode_names[mode],
+		setup / 1e6, first.minflt, first.majflt);
+	print_hists(&first, &steady);
+
+	snprintf(mech, sizeof mech, "%s_%s_first", anon ? "anon" : "file",
+		mode_names[mode]);
+	bench_csv_row(mech, pagesize, first.lat.n, first.ns, &first.lat);
+	snprintf(mech, sizeof mech, "%s_%s_steady", anon ? "anon" : "file",
+		mode_names[mode]);
+	bench_csv_row(mech, pagesize, steady.lat.n, steady.ns, &steady.lat);
+	fflush(stdout);
+
+	lat_free(&first.lat);
+	lat_free(&steady.lat);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = DEFAULT_FILE;
+	size_t mib = DEFAULT_MIB, size;
+	int opt, mode, fd, scratch = 1;
+
+	while ((opt = getopt(argc, argv, "m:f:")) != -1) {
+		switch (opt) {
+			case 'm': mib = strtoul(optarg, NULL, 0); break;
+			case 'f': path = optarg; scratch = 0; break;
+			default:
+				fprintf(stderr, "usage: prefault [-m MiB] [-f file]\n");
+				exit(1);
+		}
+	}
+
+	if (mib == 0) {
+		fprintf(stderr, "prefault: bad size\n");
+		exit(1);
+	}
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	size = mib << 20;
+
+	fd = make_file(path, size, scratch);
+	close(fd);
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (mode = 0; mode < NMODES; mode++) {
+		run(path, size, 0, mode);
+		run(path, size, 1, mode);
+	}
+
+	unlink(path);  /* ours either way; make_file() made it */
+
+	return 0;
+}
+
+#endif
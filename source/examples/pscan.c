@@ -0,0 +1,293 @@
+/*
+** pscan.c -- mmapdemo.c with helpers: map a file once and count its
+** lines on a pool of threads, or of forked children sharing the mapping
+**
+** The file is cut into page-aligned chunks.  A worker grabs the next
+** chunk number off a shared counter, scans it, and writes its result
+** into a shared array for the parent to merge.  A line can straddle a
+** chunk boundary, so a chunk really starts just after the first newline
+** at or past its nominal start (the line in progress belongs to the
+** chunk before) and ends where the next chunk starts.  That way every
+** line is seen whole by exactly one worker, and the longest line comes
+** out right, too.
+**
+** The mapping gets madvise(MADV_WILLNEED), not scan.c's MADV_SEQUENTIAL:
+** with many workers the file as a whole isn't read in order, but all of
+** it will be wanted, so the kernel may as well start reading it in.
+**
+** It runs 1, 2, 4, ... workers up to -t (default: the CPU count), threads
+** and then processes, on a warm page cache, and prints CSV (see bench.h)
+** plus a speedup table on stderr.  Once the workers saturate memory
+** bandwidth, more of them don't help.
+**
+** usage: pscan [-t max_workers] [-c chunk_KiB] [-g MiB] [file]
+**
+** With no file, it makes a -g MiB one (default 256) to scan.
+*/
+
+#ifndef __linux__
+#warning "pscan needs Linux madvise()."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define DEFAULT_CHUNK_KIB 4096
+#define DEFAULT_MIB 256
+#define SCRATCH_FILE "pscan.dat"
+
+struct result {
+	unsigned long lines;
+	size_t longest;
+};
+
+/* everything the workers share; lives in a MAP_SHARED mapping */
+struct job {
+	const char *data;
+	size_t size, chunk, nchunks;
+	size_t next;              /* next chunk to hand out */
+	struct result res[];      /* one per chunk */
+};
+
+/*
+** record_start() -- where the first whole line at or after off begins
+*/
+static size_t record_start(const struct job *j, size_t off)
+{
+	const char *nl;
+
+	if (off == 0) return 0;
+	if (off >= j->size) return j->size;
+
+	nl = memchr(j->data + off - 1, '\n', j->size - off + 1);
+
+	return nl == NULL ? j->size : (size_t)(nl - j->data) + 1;
+}
+
+static void scan_chunk(struct job *j, size_t i)
+{
+	size_t start = record_start(j, i * j->chunk);
+	size_t end = record_start(j, (i + 1) * j->chunk);
+	const char *p = j->data + start, *e = j->data + end, *nl;
+	struct result *r = &j->res[i];
+
+	r->lines = 0;
+	r->longest = 0;
+
+	while (p < e) {
+		if ((nl = memchr(p, '\n', e - p)) == NULL) nl = e;
+		else r->lines++;
+
+		if ((size_t)(nl - p) > r->longest) r->longest = nl - p;
+		p = nl + 1;
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct job *j = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) <
+	       j->nchunks)
+		scan_chunk(j, i);
+
+	return NULL;
+}
+
+/*
+** run() -- scan the whole file with n workers; returns the elapsed time
+*/
+static uint64_t run(struct job *j, int n, int procs)
+{
+	pthread_t tids[n];
+	pid_t pids[n];
+	uint64_t t0;
+	int i, status;
+
+	j->next = 0;
+
+	t0 = now_ns();
+
+	for (i = 0; i < n; i++) {
+		if (!procs) {
+			if ((errno = pthread_create(&tids[i], NULL, worker, j)) != 0) {
+				perror("pthread_create");
+				exit(1);
+			}
+			continue;
+		}
+
+		switch (pids[i] = fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0:
+				worker(j);
+				_exit(0);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!procs) {
+			pthread_join(tids[i], NULL);
+			continue;
+		}
+
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "pscan: worker failed\n");
+			exit(1);
+		}
+	}
+
+	return now_ns() - t0;
+}
+
+static struct result merge(const struct job *j)
+{
+	struct result total = { 0, 0 };
+	size_t i;
+
+	for (i = 0; i < j->nchunks; i++) {
+		total.lines += j->res[i].lines;
+		if (j->res[i].longest > total.longest)
+			total.longest = j->res[i].longest;
+	}
+
+	return total;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t chunk_kib = DEFAULT_CHUNK_KIB, mib = DEFAULT_MIB, jsize;
+	const char *path = SCRATCH_FILE;
+	int opt, procs, n, maxw = 0, scratch = 0, fd;
+	uint64_t base[2] = { 0, 0 };
+	struct result want, got;
+	struct stat sb;
+	struct job *j;
+	char *data;
+
+	while ((opt = getopt(argc, argv, "t:c:g:")) != -1) {
+		switch (opt) {
+			case 't': maxw = atoi(optarg); break;
+			case 'c': chunk_kib = strtoul(optarg, NULL, 0); break;
+			case 'g': mib = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: pscan [-t max_workers] [-c chunk_KiB] "
+					"[-g MiB] [file]\n");
+				exit(1);
+		}
+	}
+
+	if (maxw <= 0) maxw = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* chunks must be whole pages so a worker never shares one */
+	if (chunk_kib == 0 || (chunk_kib << 10) % sysconf(_SC_PAGESIZE) != 0) {
+		fprintf(stderr, "pscan: chunk must be a multiple of the page size\n");
+		exit(1);
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+	else {
+		bench_make_file(path, mib);
+		scratch = 1;
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		perror(path);
+		exit(1);
+	}
+	if (fstat(fd, &sb) == -1) {
+		perror("fstat");
+		exit(1);
+	}
+	if (sb.st_size == 0) {
+		fprintf(stderr, "pscan: %s is empty\n", path);
+		exit(1);
+	}
+
+	if ((data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+	madvise(data, sb.st_size, MADV_WILLNEED);
+
+	jsize = sizeof *j;
+	jsize += (sb.st_size / (chunk_kib << 10) + 1) * sizeof(struct result);
+
+	j = mmap(NULL, jsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		-1, 0);
+	if (j == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	j->data = data;
+	j->size = sb.st_size;
+	j->chunk = chunk_kib << 10;
+	j->nchunks = (j->size + j->chunk - 1) / j->chunk;
+
+	/* one unreported pass to pull the file into the page cache, and to
+	   get the answer every other run has to match */
+	run(j, 1, 0);
+	want = merge(j);
+
+	bench_csv_header();
+	fflush(stdout);
+
+	fprintf(stderr, "%-7s %7s %9s %8s %10s\n", "", "workers", "MB/s",
+		"speedup", "efficiency");
+
+	for (procs = 0; procs <= 1; procs++) {
+		for (n = 1; n <= maxw; n = n * 2 > maxw && n < maxw ? maxw : n * 2) {
+			uint64_t ns = run(j, n, procs);
+			char mech[64];
+
+			got = merge(j);
+			if (got.lines != want.lines || got.longest != want.longest)
+				fprintf(stderr, "%d %s: got %lu lines (longest %zu), not "
+					"%lu (%zu)!\n", n, procs ? "procs" : "threads",
+					got.lines, got.longest, want.lines, want.longest);
+
+			if (n == 1) base[procs] = ns;
+
+			fprintf(stderr, "%-7s %7d %9.1f %7.2fx %9.0f%%\n",
+				procs ? "procs" : "threads", n, j->size / (ns / 1e9) / 1e6,
+				(double)base[procs] / ns, 100.0 * base[procs] / ns / n);
+
+			snprintf(mech, sizeof mech, "mmap_%s_%d",
+				procs ? "procs" : "threads", n);
+			bench_csv_row(mech, j->size, 1, ns, NULL);
+			fflush(stdout);
+		}
+	}
+
+	fprintf(stderr, "%s: %zu bytes in %zu chunks, %lu lines, longest %zu\n",
+		path, j->size, j->nchunks, want.lines, want.longest);
+
+	munmap(j, jsize);
+	munmap(data, sb.st_size);
+	if (scratch) unlink(path);
+
+	return 0;
+}
+
+#endif
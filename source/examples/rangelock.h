@@ -0,0 +1,145 @@
+/*
+** rangelock.h -- lock just the records of a file you're touching, with
+** fcntl(), and keep score of who had to wait for them
+**
+** lockdemo.c locks the whole file (l_len = 0), so two processes
+** updating different records still take turns.  Here a file is an array
+** of fixed-size records, and rlock_lock() locks only the records it's
+** asked for.
+**
+** By default the locks are open file description ("OFD") locks, from
+** F_OFD_SETLKW.  Classic F_SETLKW locks belong to the process, so
+** threads sharing a process never block each other, and closing any fd
+** on the file drops all of them.  OFD locks belong to the open(), so
+** each thread (or process) that opens the file for itself gets locks
+** that work against everyone else's.
+**
+** Each lock first tries F_OFD_SETLK.  If that's refused, somebody holds
+** an overlapping range: we count a conflict for the first record and
+** time the F_OFD_SETLKW that waits it out.  The counters are updated
+** atomically, so they can live in memory shared by all the lockers.
+*/
+
+#ifndef RANGELOCK_H
+#define RANGELOCK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "bench.h"
+
+/* per-record score; n_records of these, or none */
+struct rlock_stats {
+	uint64_t locks;      /* locks granted on ranges starting here */
+	uint64_t conflicts;  /* ...that had to wait */
+	uint64_t wait_ns;    /* total time spent waiting */
+	uint64_t wait_max_ns;
+};
+
+struct rlock {
+	int fd;
+	int cmd_try, cmd_wait;  /* F_OFD_SETLK/W, or F_SETLK/W */
+	off_t recsize;
+	size_t nrecs;
+	struct rlock_stats *stats;
+};
+
+/*
+** rlock_init() -- set up to lock records of recsize bytes in fd.  stats
+** is an array of nrecs counters, or NULL to keep no score.  If ofd is
+** 0, or the system has no OFD locks, we use classic process locks.
+*/
+static inline void rlock_init(struct rlock *rl, int fd, off_t recsize,
+	size_t nrecs, struct rlock_stats *stats, int ofd)
+{
+	rl->fd = fd;
+	rl->recsize = recsize;
+	rl->nrecs = nrecs;
+	rl->stats = stats;
+
+#ifdef F_OFD_SETLKW
+	if (ofd) {
+		rl->cmd_try = F_OFD_SETLK;
+		rl->cmd_wait = F_OFD_SETLKW;
+		return;
+	}
+#else
+	(void)ofd;
+#endif
+
+	rl->cmd_try = F_SETLK;
+	rl->cmd_wait = F_SETLKW;
+}
+
+static inline int rlock_fcntl(struct rlock *rl, int cmd, size_t rec,
+	size_t n, short type)
+{
+	struct flock fl;
+	int r;
+
+	memset(&fl, 0, sizeof fl);  /* OFD locks insist that l_pid be 0 */
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (off_t)rec * rl->recsize;
+	fl.l_len = (off_t)n * rl->recsize;  /* 0 means "to the end of file" */
+
+	while ((r = fcntl(rl->fd, cmd, &fl)) == -1 && errno == EINTR &&
+	       cmd == rl->cmd_wait)
+		;
+
+	return r;
+}
+
+/*
+** rlock_lock() -- lock records rec through rec+n-1, F_RDLCK or F_WRLCK,
+** waiting if we have to.  n == 0 locks from rec to the end of the file
+** and beyond, like l_len = 0 does; rlock_lock(rl, 0, 0, F_WRLCK) is
+** lockdemo.c's whole-file lock.  Returns -1 with errno set on error.
+*/
+static inline int rlock_lock(struct rlock *rl, size_t rec, size_t n,
+	short type)
+{
+	struct rlock_stats *st = NULL;
+	uint64_t t0, w;
+
+	if (rl->stats != NULL && rec < rl->nrecs) st = &rl->stats[rec];
+
+	if (rlock_fcntl(rl, rl->cmd_try, rec, n, type) == 0) {
+		if (st != NULL) __atomic_fetch_add(&st->locks, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (errno != EAGAIN && errno != EACCES) return -1;
+
+	/* somebody's in our range; wait for them and time it */
+	t0 = now_ns();
+	if (rlock_fcntl(rl, rl->cmd_wait, rec, n, type) == -1) return -1;
+	w = now_ns() - t0;
+
+	if (st != NULL) {
+		uint64_t max = __atomic_load_n(&st->wait_max_ns, __ATOMIC_RELAXED);
+
+		__atomic_fetch_add(&st->locks, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->conflicts, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->wait_ns, w, __ATOMIC_RELAXED);
+		while (w > max && !__atomic_compare_exchange_n(&st->wait_max_ns,
+		       &max, w, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+
+	return 0;
+}
+
+/*
+** rlock_unlock() -- unlock the same records rlock_lock() locked
+*/
+static inline int rlock_unlock(struct rlock *rl, size_t rec, size_t n)
+{
+	return rlock_fcntl(rl, rl->cmd_try, rec, n, F_UNLCK);
+}
+
+#endif
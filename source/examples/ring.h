@@ -0,0 +1,272 @@
+/*
+** ring.h -- a lock-free single-producer/single-consumer ring buffer of
+** fixed-size records that lives in shared memory
+**
+** One process calls ring_push(), the other calls ring_pop(), and no
+** system calls are made as long as the ring is neither full nor empty.
+** The head and tail indices live on their own cache lines so the two
+** sides don't bounce a line back and forth on every record.
+**
+** On Linux there's also ring_push_wait()/ring_pop_wait(), which spin
+** for a bit and then sleep on a futex in the ring itself, so a side
+** only enters the kernel when it has to sleep or wake a sleeper.  Use
+** the _wait versions on both sides or on neither.
+*/
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define RING_CACHELINE 64
+#define RING_SPINS 200  /* spins before we yield or sleep */
+
+struct ring {
+	/* producer's line: head is only written by the producer */
+	_Alignas(RING_CACHELINE) _Atomic uint64_t head;
+	uint64_t tail_cache;  /* producer's last look at tail */
+	_Atomic uint32_t prod_waiting;  /* futex: producer asleep on full */
+
+	/* consumer's line: tail is only written by the consumer */
+	_Alignas(RING_CACHELINE) _Atomic uint64_t tail;
+	uint64_t head_cache;  /* consumer's last look at head */
+	_Atomic uint32_t cons_waiting;  /* futex: consumer asleep on empty */
+
+	/* read-only after ring_init() */
+	_Alignas(RING_CACHELINE) uint32_t cap;
+	uint32_t mask;
+	uint32_t recsize;
+	uint32_t stride;
+	uint32_t spins;  /* RING_SPINS, or 1 on a uniprocessor */
+
+	_Alignas(RING_CACHELINE) unsigned char data[];
+};
+
+static inline void ring_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline uint32_t ring_stride(uint32_t recsize)
+{
+	return (recsize + 7) & ~7u;  /* keep records 8-byte aligned */
+}
+
+/*
+** ring_bytes() -- how much memory a ring of cap records needs
+*/
+static inline size_t ring_bytes(uint32_t cap, uint32_t recsize)
+{
+	return sizeof(struct ring) + (size_t)cap * ring_stride(recsize);
+}
+
+/*
+** ring_init() -- set up a ring in memory of at least ring_bytes() bytes.
+** cap must be a power of two.  Returns -1 with errno set on error.
+*/
+static inline int ring_init(struct ring *r, uint32_t cap, uint32_t recsize)
+{
+	if (cap == 0 || (cap & (cap - 1)) != 0 || recsize == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->prod_waiting, 0);
+	atomic_init(&r->cons_waiting, 0);
+	r->tail_cache = r->head_cache = 0;
+	r->cap = cap;
+	r->mask = cap - 1;
+	r->recsize = recsize;
+	r->stride = ring_stride(recsize);
+
+	/* spinning just burns the peer's timeslice if there's one CPU */
+	r->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPINS : 1;
+
+	return 0;
+}
+
+/*
+** ring_create() -- map an anonymous shared region (as in mmap_anon.c)
+** and build a ring in it.  The ring is shared with children forked
+** after this call.  Returns NULL on error.
+*/
+static inline struct ring *ring_create(uint32_t cap, uint32_t recsize)
+{
+	struct ring *r;
+
+	r = mmap(NULL, ring_bytes(cap, recsize), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED) return NULL;
+
+	if (ring_init(r, cap, recsize) == -1) {
+		int e = errno;
+		munmap(r, ring_bytes(cap, recsize));
+		errno = e;
+		return NULL;
+	}
+
+	return r;
+}
+
+static inline void ring_destroy(struct ring *r)
+{
+	munmap(r, ring_bytes(r->cap, r->recsize));
+}
+
+/*
+** ring_trypush() -- copy one record in.  Returns 0, or -1 if full.
+*/
+static inline int ring_trypush(struct ring *r, const void *rec)
+{
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head - r->tail_cache == r->cap) {
+		/* looks full; go get the real tail (and the consumer's writes) */
+		r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (head - r->tail_cache == r->cap) return -1;
+	}
+
+	memcpy(r->data + (head & r->mask) * r->stride, rec, r->recsize);
+
+	/* release: the record bytes are visible before the new head is */
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+	return 0;
+}
+
+/*
+** ring_trypop() -- copy one record out.  Returns 0, or -1 if empty.
+*/
+static inline int ring_trypop(struct ring *r, void *rec)
+{
+	uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	if (tail == r->head_cache) {
+		r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+		if (tail == r->head_cache) return -1;
+	}
+
+	memcpy(rec, r->data + (tail & r->mask) * r->stride, r->recsize);
+
+	/* release: we're done reading the slot before the producer reuses it */
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+	return 0;
+}
+
+/*
+** ring_push()/ring_pop() -- blocking versions.  These spin for a while
+** and then start yielding the CPU, which matters when both processes
+** share a core.
+*/
+static inline void ring_push(struct ring *r, const void *rec)
+{
+	unsigned spins = 0;
+
+	while (ring_trypush(r, rec) == -1)
+		if (++spins < r->spins) ring_cpu_relax();
+		else sched_yield();
+}
+
+static inline void ring_pop(struct ring *r, void *rec)
+{
+	unsigned spins = 0;
+
+	while (ring_trypop(r, rec) == -1)
+		if (++spins < r->spins) ring_cpu_relax();
+		else sched_yield();
+}
+
+#ifdef __linux__
+/*
+** The futex words aren't private (no FUTEX_PRIVATE_FLAG) because the
+** ring is shared between processes.
+*/
+static inline long ring_futex(_Atomic uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/*
+** A sleeper sets its waiting flag and then looks at the ring one more
+** time before parking; a waker publishes its index and then checks the
+** flag.  The seq_cst fences on both sides guarantee that at least one
+** of them sees the other, so no wakeup is ever lost.
+*/
+static inline void ring_wake(_Atomic uint32_t *waiting)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(waiting, memory_order_relaxed) &&
+	    atomic_exchange(waiting, 0))
+		ring_futex(waiting, FUTEX_WAKE, 1);
+}
+
+static inline void ring_push_wait(struct ring *r, const void *rec)
+{
+	unsigned spins = 0;
+
+	while (ring_trypush(r, rec) == -1) {
+		if (++spins < r->spins) {
+			ring_cpu_relax();
+			continue;
+		}
+
+		atomic_store(&r->prod_waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ring_trypush(r, rec) == 0) {
+			atomic_store(&r->prod_waiting, 0);
+			break;
+		}
+		ring_futex(&r->prod_waiting, FUTEX_WAIT, 1);
+		spins = 0;
+	}
+
+	ring_wake(&r->cons_waiting);
+}
+
+static inline void ring_pop_wait(struct ring *r, void *rec)
+{
+	unsigned spins = 0;
+
+	while (ring_trypop(r, rec) == -1) {
+		if (++spins < r->spins) {
+			ring_cpu_relax();
+			continue;
+		}
+
+		atomic_store(&r->cons_waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ring_trypop(r, rec) == 0) {
+			atomic_store(&r->cons_waiting, 0);
+			break;
+		}
+		ring_futex(&r->cons_waiting, FUTEX_WAIT, 1);
+		spins = 0;
+	}
+
+	ring_wake(&r->prod_waiting);
+}
+#endif
+
+#endif
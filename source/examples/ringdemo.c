@@ -0,0 +1,219 @@
+/*
+** ringdemo.c -- streams fixed-size records from a parent to a child
+** through the lock-free ring in ring.h, sitting in an mmap_anon.c-style
+** shared mapping
+**
+** usage: ringdemo [-n records] [-r recsize] [-c capacity]
+**        ringdemo -b [-n records] [-c capacity]
+**
+** With -b it prints CSV comparing the ring to a pipe2.c-style pipe
+** (one write() per record) over a sweep of record sizes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "ring.h"
+
+#define DEFAULT_RECORDS 10000000
+#define DEFAULT_RECSIZE 64
+#define DEFAULT_CAP 4096  /* records; must be a power of two */
+
+#define BENCH_MIN 8
+#define BENCH_MAX 4096
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+/*
+** Every record starts with its sequence number so the consumer can
+** prove nothing was lost, duplicated, or reordered.
+*/
+static void consume_check(size_t i, const char *rec)
+{
+	uint64_t seq;
+
+	memcpy(&seq, rec, sizeof seq);
+	if (seq != i) {
+		fprintf(stderr, "child: expected record %zu, got %llu\n", i,
+			(unsigned long long)seq);
+		_exit(1);
+	}
+}
+
+static void wait_child(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) == -1) {
+		perror("waitpid");
+		exit(1);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "ringdemo: child failed\n");
+		exit(1);
+	}
+}
+
+/*
+** stream_ring() -- push n records through the ring; returns elapsed ns
+*/
+static uint64_t stream_ring(size_t n, uint32_t recsize, uint32_t cap)
+{
+	struct ring *r;
+	char *rec;
+	uint64_t t0, i;
+	pid_t pid;
+
+	if ((r = ring_create(cap, recsize)) == NULL) {
+		perror("ring_create");
+		exit(1);
+	}
+	if ((rec = calloc(1, recsize)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	t0 = now_ns();
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			for (i = 0; i < n; i++) {
+				ring_pop(r, rec);
+				consume_check(i, rec);
+			}
+			_exit(0);
+
+		default:
+			for (i = 0; i < n; i++) {
+				memcpy(rec, &i, sizeof i);
+				ring_push(r, rec);
+			}
+			wait_child(pid);
+			break;
+	}
+
+	free(rec);
+	ring_destroy(r);
+
+	return now_ns() - t0;
+}
+
+/*
+** stream_pipe() -- same thing through a pipe, one write() per record
+*/
+static uint64_t stream_pipe(size_t n, uint32_t recsize)
+{
+	int pfds[2];
+	char *rec;
+	uint64_t t0, i;
+	pid_t pid;
+
+	if (pipe(pfds) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	if ((rec = calloc(1, recsize)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	t0 = now_ns();
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			close(pfds[1]);
+			for (i = 0; i < n; i++) {
+				if (readn(pfds[0], rec, recsize) != recsize) {
+					perror("child: read");
+					_exit(1);
+				}
+				consume_check(i, rec);
+			}
+			_exit(0);
+
+		default:
+			close(pfds[0]);
+			for (i = 0; i < n; i++) {
+				memcpy(rec, &i, sizeof i);
+				if (writen(pfds[1], rec, recsize) == -1) {
+					perror("write");
+					exit(1);
+				}
+			}
+			close(pfds[1]);
+			wait_child(pid);
+			break;
+	}
+
+	free(rec);
+
+	return now_ns() - t0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t records = 0;
+	uint32_t recsize = DEFAULT_RECSIZE, cap = DEFAULT_CAP;
+	int opt, bench = 0;
+
+	while ((opt = getopt(argc, argv, "bn:r:c:")) != -1) {
+		switch (opt) {
+			case 'b': bench = 1; break;
+			case 'n': records = strtoul(optarg, NULL, 0); break;
+			case 'r': recsize = strtoul(optarg, NULL, 0); break;
+			case 'c': cap = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: ringdemo [-b] [-n records] "
+					"[-r recsize] [-c capacity]\n");
+				exit(1);
+		}
+	}
+
+	if (recsize < sizeof(uint64_t)) {
+		fprintf(stderr, "ringdemo: records must be at least %zu bytes\n",
+			sizeof(uint64_t));
+		exit(1);
+	}
+
+	if (bench) {
+		bench_csv_header();
+		fflush(stdout);
+
+		for (recsize = BENCH_MIN; recsize <= BENCH_MAX; recsize *= 2) {
+			size_t n = records ? records :
+				bench_count(recsize, BENCH_BYTES, 10000, 2000000);
+
+			bench_csv_row("spsc_ring", recsize, n,
+				stream_ring(n, recsize, cap), NULL);
+			bench_csv_row("pipe", recsize, n, stream_pipe(n, recsize), NULL);
+		}
+	} else {
+		uint64_t ns;
+
+		if (records == 0) records = DEFAULT_RECORDS;
+
+		printf("parent: streaming %zu %u-byte records through a "
+			"%u-slot ring\n", records, recsize, cap);
+		fflush(stdout);
+
+		ns = stream_ring(records, recsize, cap);
+
+		printf("parent: child got them all in %.3f s (%.0f records/s)\n",
+			ns / 1e9, records / (ns / 1e9));
+	}
+
+	return 0;
+}
@@ -0,0 +1,277 @@
+/*
+** rwbench.c -- N readers and one writer sharing a shmdemo.c-style 1K
+** segment, locked three ways:
+**
+**   sysv_sem      semdemo.c's single binary semaphore: one at a time
+**   rwlock        rwlock.h, readers first
+**   rwlock_wpref  rwlock.h, writers first
+**
+** Readers copy the whole segment out as fast as they can; the writer
+** rewrites it every so often.  Prints CSV (see bench.h) with read
+** throughput for 1, 2, 4, ... readers, and the writer's wait for the
+** lock on stderr.
+**
+** usage: rwbench [-r max_readers] [-t ms] [-w writer_interval_us]
+*/
+
+#ifndef __linux__
+#warning "rwbench needs Linux futexes."
+int main(void) {}
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+
+#include "bench.h"
+#include "rwlock.h"
+
+#define SHM_SIZE 1024      /* same as shmdemo.c */
+#define MAX_READERS 64
+#define CACHELINE 64
+
+enum { SYSV_SEM, RWLOCK, RWLOCK_WPREF };
+
+static const char *mech_names[] = { "sysv_sem", "rwlock", "rwlock_wpref" };
+
+/*
+** The segment: the lock, some bookkeeping for the benchmark, and
+** shmdemo.c's 1K of data.
+*/
+struct shared {
+	struct rwlock lock;
+	_Atomic int ready, go, stop;
+
+	/* one counter per reader, each on its own cache line */
+	struct {
+		_Alignas(CACHELINE) unsigned long reads, torn;
+	} reader[MAX_READERS];
+
+	_Alignas(CACHELINE) unsigned long writes;
+	uint64_t write_wait_ns, write_wait_max_ns;
+
+	_Alignas(CACHELINE) char data[SHM_SIZE];
+};
+
+static struct shared *sh;
+static int semid;
+
+static void lock(int mech, int write)
+{
+	struct sembuf sb = { 0, -1, SEM_UNDO };
+
+	switch (mech) {
+		case SYSV_SEM:
+			while (semop(semid, &sb, 1) == -1)
+				if (errno != EINTR) {
+					perror("semop");
+					exit(1);
+				}
+			break;
+
+		default:
+			if (write) rwlock_wrlock(&sh->lock);
+			else rwlock_rdlock(&sh->lock);
+	}
+}
+
+static void unlock(int mech, int write)
+{
+	struct sembuf sb = { 0, 1, SEM_UNDO };
+
+	switch (mech) {
+		case SYSV_SEM:
+			if (semop(semid, &sb, 1) == -1) {
+				perror("semop");
+				exit(1);
+			}
+			break;
+
+		default:
+			if (write) rwlock_wrunlock(&sh->lock);
+			else rwlock_rdunlock(&sh->lock);
+	}
+}
+
+static void wait_for_go(void)
+{
+	atomic_fetch_add(&sh->ready, 1);
+	while (!atomic_load(&sh->go))
+		sched_yield();
+}
+
+/*
+** reader() -- copy the segment out until told to stop.  The writer
+** fills it with one letter, so anything else means the lock let us
+** see a write half done.
+*/
+static void reader(int mech, int id)
+{
+	char copy[SHM_SIZE];
+	unsigned long reads = 0, torn = 0;
+
+	wait_for_go();
+
+	while (!atomic_load_explicit(&sh->stop, memory_order_relaxed)) {
+		lock(mech, 0);
+		memcpy(copy, sh->data, SHM_SIZE);
+		unlock(mech, 0);
+
+		if (copy[0] != copy[SHM_SIZE - 2]) torn++;
+		reads++;
+	}
+
+	sh->reader[id].reads = reads;
+	sh->reader[id].torn = torn;
+}
+
+static void writer(int mech, unsigned interval_us)
+{
+	unsigned long writes = 0;
+	uint64_t wait_ns = 0, wait_max = 0;
+
+	wait_for_go();
+
+	while (!atomic_load_explicit(&sh->stop, memory_order_relaxed)) {
+		uint64_t t0 = now_ns(), w;
+
+		lock(mech, 1);
+		w = now_ns() - t0;
+		memset(sh->data, 'a' + writes % 26, SHM_SIZE - 1);
+		sh->data[SHM_SIZE - 1] = '\0';
+		unlock(mech, 1);
+
+		writes++;
+		wait_ns += w;
+		if (w > wait_max) wait_max = w;
+
+		if (interval_us > 0) usleep(interval_us);
+	}
+
+	sh->writes = writes;
+	sh->write_wait_ns = wait_ns;
+	sh->write_wait_max_ns = wait_max;
+}
+
+/*
+** run() -- one round: nreaders readers and a writer for ms milliseconds
+*/
+static void run(int mech, int nreaders, unsigned ms, unsigned interval_us)
+{
+	unsigned long reads = 0, torn = 0;
+	union { int val; } arg = { 1 };  /* union semun, cut down */
+	uint64_t elapsed;
+	char name[64];
+	int i, status;
+
+	memset(sh, 0, sizeof *sh);
+	rwlock_init(&sh->lock, mech == RWLOCK_WPREF);
+	memset(sh->data, 'a', SHM_SIZE - 1);
+
+	if (semctl(semid, 0, SETVAL, arg) == -1) {
+		perror("semctl");
+		exit(1);
+	}
+
+	for (i = 0; i <= nreaders; i++) {
+		switch (fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0:
+				if (i < nreaders) reader(mech, i);
+				else writer(mech, interval_us);
+				_exit(0);
+		}
+	}
+
+	while (atomic_load(&sh->ready) < nreaders + 1)
+		sched_yield();
+
+	elapsed = now_ns();
+	atomic_store(&sh->go, 1);
+	usleep(ms * 1000);
+	atomic_store(&sh->stop, 1);
+
+	while (wait(&status) != -1)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "rwbench: a child failed\n");
+			exit(1);
+		}
+	elapsed = now_ns() - elapsed;
+
+	for (i = 0; i < nreaders; i++) {
+		reads += sh->reader[i].reads;
+		torn += sh->reader[i].torn;
+	}
+
+	snprintf(name, sizeof name, "%s_%dr", mech_names[mech], nreaders);
+	bench_csv_row(name, SHM_SIZE, reads, elapsed, NULL);
+	fflush(stdout);
+
+	fprintf(stderr, "%s: %lu writes, writer waited %.1f us on average, "
+		"%.1f us at most%s\n", name, sh->writes,
+		sh->writes ? sh->write_wait_ns / 1000.0 / sh->writes : 0.0,
+		sh->write_wait_max_ns / 1000.0, torn ? ", TORN READS!" : "");
+}
+
+int main(int argc, char *argv[])
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, shmid, mech, n, max_readers = 0;
+	unsigned ms = 300, interval_us = 1000;
+
+	while ((opt = getopt(argc, argv, "r:t:w:")) != -1) {
+		switch (opt) {
+			case 'r': max_readers = atoi(optarg); break;
+			case 't': ms = strtoul(optarg, NULL, 0); break;
+			case 'w': interval_us = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: rwbench [-r max_readers] [-t ms] "
+					"[-w writer_interval_us]\n");
+				exit(1);
+		}
+	}
+
+	if (max_readers <= 0) max_readers = ncpu > 2 ? ncpu : 4;
+	if (max_readers > MAX_READERS) max_readers = MAX_READERS;
+
+	/* private segment and semaphore; they go away when we're done */
+	if ((shmid = shmget(IPC_PRIVATE, sizeof *sh, 0600)) == -1) {
+		perror("shmget");
+		exit(1);
+	}
+	sh = shmat(shmid, NULL, 0);
+	shmctl(shmid, IPC_RMID, NULL);  /* gone once everyone detaches */
+	if (sh == (void *)-1) {
+		perror("shmat");
+		exit(1);
+	}
+
+	if ((semid = semget(IPC_PRIVATE, 1, 0600)) == -1) {
+		perror("semget");
+		exit(1);
+	}
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (mech = SYSV_SEM; mech <= RWLOCK_WPREF; mech++)
+		for (n = 1; n <= max_readers; n *= 2)
+			run(mech, n, ms, interval_us);
+
+	semctl(semid, 0, IPC_RMID);
+	shmdt(sh);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,193 @@
+/*
+** rwlock.h -- a reader-writer lock that lives in shared memory
+**
+** semdemo.c's binary semaphore lets one process in at a time, readers
+** included.  This lock lets any number of readers in together and a
+** writer in alone.  Everything happens with atomics on one word; a
+** process only enters the kernel (a futex) to sleep, or to wake someone
+** who's sleeping.
+**
+** With writer preference, a waiting writer holds off new readers, so a
+** steady stream of readers can't keep it out forever.  Without it,
+** readers never wait for anything but a writer that's already in.
+**
+** Linux only, for the futexes.
+*/
+
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define RWLOCK_SPINS 100  /* spins before we sleep */
+
+/* the state word */
+#define RW_WRITER     0x80000000u  /* a writer holds the lock */
+#define RW_WWAIT_ONE  0x00010000u  /* one waiting writer */
+#define RW_WWAIT_MASK 0x7fff0000u
+#define RW_READERS    0x0000ffffu  /* readers holding the lock */
+
+struct rwlock {
+	_Atomic uint32_t state;
+
+	/*
+	** Sleepers park on these sequence numbers, and a waker bumps one
+	** before FUTEX_WAKE so nobody can go to sleep on a stale value.
+	*/
+	_Atomic uint32_t rseq, wseq;
+	_Atomic uint32_t rsleepers, wsleepers;
+
+	uint32_t prefer_writer;
+	uint32_t spins;  /* RWLOCK_SPINS, or 1 on a uniprocessor */
+};
+
+static inline void rwlock_init(struct rwlock *l, int prefer_writer)
+{
+	atomic_init(&l->state, 0);
+	atomic_init(&l->rseq, 0);
+	atomic_init(&l->wseq, 0);
+	atomic_init(&l->rsleepers, 0);
+	atomic_init(&l->wsleepers, 0);
+	l->prefer_writer = prefer_writer;
+	l->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RWLOCK_SPINS : 1;
+}
+
+static inline long rwlock_futex(_Atomic uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static inline void rwlock_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline int rwlock_read_blocked(const struct rwlock *l, uint32_t s)
+{
+	return (s & RW_WRITER) || (l->prefer_writer && (s & RW_WWAIT_MASK));
+}
+
+static inline int rwlock_write_blocked(uint32_t s)
+{
+	return (s & RW_WRITER) || (s & RW_READERS);
+}
+
+/*
+** rwlock_sleep() -- park on seq until a waker bumps it, unless the lock
+** has already opened up.  As in ring.h, the sleeper says it's sleeping
+** and then looks one more time, and the waker changes the state and
+** then looks for sleepers; the fences make sure one sees the other.
+*/
+static inline void rwlock_sleep(struct rwlock *l, _Atomic uint32_t *seq,
+	_Atomic uint32_t *sleepers, int writer)
+{
+	uint32_t seen = atomic_load(seq);
+	uint32_t s;
+
+	atomic_fetch_add(sleepers, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	s = atomic_load_explicit(&l->state, memory_order_relaxed);
+	if (writer ? rwlock_write_blocked(s) : rwlock_read_blocked(l, s))
+		rwlock_futex(seq, FUTEX_WAIT, seen);
+
+	atomic_fetch_sub(sleepers, 1);
+}
+
+static inline void rwlock_wake(_Atomic uint32_t *seq,
+	_Atomic uint32_t *sleepers, int n)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(sleepers, memory_order_relaxed)) {
+		atomic_fetch_add(seq, 1);
+		rwlock_futex(seq, FUTEX_WAKE, n);
+	}
+}
+
+static inline void rwlock_rdlock(struct rwlock *l)
+{
+	unsigned spins = 0;
+
+	for (;;) {
+		uint32_t s = atomic_load_explicit(&l->state, memory_order_relaxed);
+
+		if (!rwlock_read_blocked(l, s)) {
+			if (atomic_compare_exchange_weak_explicit(&l->state, &s, s + 1,
+			    memory_order_acquire, memory_order_relaxed))
+				return;
+			continue;  /* lost a race with another reader; go again */
+		}
+
+		if (++spins < l->spins)
+			rwlock_relax();
+		else {
+			rwlock_sleep(l, &l->rseq, &l->rsleepers, 0);
+			spins = 0;
+		}
+	}
+}
+
+static inline void rwlock_rdunlock(struct rwlock *l)
+{
+	uint32_t s = atomic_fetch_sub_explicit(&l->state, 1,
+		memory_order_release) - 1;
+
+	/* last reader out lets a waiting writer in */
+	if ((s & RW_READERS) == 0 && (s & RW_WWAIT_MASK))
+		rwlock_wake(&l->wseq, &l->wsleepers, 1);
+}
+
+static inline void rwlock_wrlock(struct rwlock *l)
+{
+	unsigned spins = 0;
+
+	/* get in line; with writer preference this holds off new readers */
+	atomic_fetch_add_explicit(&l->state, RW_WWAIT_ONE, memory_order_relaxed);
+
+	for (;;) {
+		uint32_t s = atomic_load_explicit(&l->state, memory_order_relaxed);
+
+		if (!rwlock_write_blocked(s)) {
+			if (atomic_compare_exchange_weak_explicit(&l->state, &s,
+			    (s - RW_WWAIT_ONE) | RW_WRITER,
+			    memory_order_acquire, memory_order_relaxed))
+				return;
+			continue;
+		}
+
+		if (++spins < l->spins)
+			rwlock_relax();
+		else {
+			rwlock_sleep(l, &l->wseq, &l->wsleepers, 1);
+			spins = 0;
+		}
+	}
+}
+
+static inline void rwlock_wrunlock(struct rwlock *l)
+{
+	uint32_t s = atomic_fetch_and_explicit(&l->state, ~RW_WRITER,
+		memory_order_release) & ~RW_WRITER;
+
+	/*
+	** Hand off to the next writer if there is one.  The readers get to
+	** go too, unless writers come first and one is still waiting.
+	*/
+	if (s & RW_WWAIT_MASK)
+		rwlock_wake(&l->wseq, &l->wsleepers, 1);
+	if (!rwlock_read_blocked(l, s))
+		rwlock_wake(&l->rseq, &l->rsleepers, INT_MAX);
+}
+
+#endif
@@ -0,0 +1,220 @@
+/*
+** scan.c -- mmapdemo.c grown up: read a whole (big) file and count its
+** lines, several different ways, to see which is fastest
+**
+**   mmap       map it, with madvise(MADV_SEQUENTIAL) so the kernel
+**              reads ahead hard and drops pages behind us
+**   mmap_huge  the same plus MADV_HUGEPAGE, where the filesystem can
+**              hand out huge pages for the page cache
+**   read       read() into a page-aligned buffer
+**   direct     read() with O_DIRECT: straight from the device into our
+**              buffer, no page cache at all
+**
+** Each is run cold (after asking the kernel to drop the file from the
+** page cache) and then warm.  Prints CSV (see bench.h): one "message" is
+** one pass over the file, so mb_per_s is the scan rate.
+**
+** usage: scan [-b bufsize] [-g MiB] [file]
+**
+** With no file, it makes a -g MiB one (default 256) to scan.
+*/
+
+#ifndef __linux__
+#warning "scan needs Linux O_DIRECT and madvise()."
+int main(void) {}
+#else
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "bench.h"
+
+#define DEFAULT_BUFSIZE (1024 * 1024)
+#define DEFAULT_MIB 256
+#define SCRATCH_FILE "scan.dat"
+#define ALIGN 4096   /* O_DIRECT wants the buffer, offset and length aligned */
+
+enum { SCAN_MMAP, SCAN_MMAP_HUGE, SCAN_READ, SCAN_DIRECT, NMODES };
+
+static const char *mode_names[] = { "mmap", "mmap_huge", "read", "direct" };
+
+/*
+** count_lines() -- the "real work": memchr() is about as fast as it
+** gets, and it has to look at every byte
+*/
+static unsigned long count_lines(const char *p, size_t n)
+{
+	const char *end = p + n;
+	unsigned long lines = 0;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		lines++;
+		p++;
+	}
+
+	return lines;
+}
+
+static int scan_mmap(const char *path, int huge, unsigned long *lines)
+{
+	struct stat sb;
+	char *data;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) return -1;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return -1;
+
+	madvise(data, sb.st_size, MADV_SEQUENTIAL);
+	if (huge) madvise(data, sb.st_size, MADV_HUGEPAGE);
+
+	*lines = count_lines(data, sb.st_size);
+
+	munmap(data, sb.st_size);
+
+	return 0;
+}
+
+static int scan_read(const char *path, int direct, size_t bufsize,
+	unsigned long *lines)
+{
+	void *buf;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | (direct ? O_DIRECT : 0))) == -1)
+		return -1;
+
+	if ((errno = posix_memalign(&buf, ALIGN, bufsize)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (!direct) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	*lines = 0;
+
+	/* with O_DIRECT, the last read just comes up short */
+	while ((n = read(fd, buf, bufsize)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		*lines += count_lines(buf, n);
+	}
+
+	free(buf);
+	close(fd);
+
+	return n == -1 ? -1 : 0;
+}
+
+/*
+** drop_cache() -- ask the kernel to forget the file's cached pages.
+** It only drops clean ones, which is why bench_make_file() syncs.
+*/
+static void drop_cache(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd != -1) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t bufsize = DEFAULT_BUFSIZE, mib = DEFAULT_MIB;
+	const char *path = SCRATCH_FILE;
+	unsigned long lines, expect = 0;
+	int opt, mode, warm, scratch = 0;
+	struct stat sb;
+
+	while ((opt = getopt(argc, argv, "b:g:")) != -1) {
+		switch (opt) {
+			case 'b': bufsize = strtoul(optarg, NULL, 0); break;
+			case 'g': mib = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: scan [-b bufsize] [-g MiB] [file]\n");
+				exit(1);
+		}
+	}
+
+	if (bufsize == 0 || bufsize % ALIGN != 0) {
+		fprintf(stderr, "scan: bufsize must be a multiple of %d\n", ALIGN);
+		exit(1);
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+	else {
+		bench_make_file(path, mib);
+		scratch = 1;
+	}
+
+	if (stat(path, &sb) == -1) {
+		perror(path);
+		exit(1);
+	}
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (mode = 0; mode < NMODES; mode++) {
+		for (warm = 0; warm <= 1; warm++) {
+			char mech[64];
+			uint64_t t0;
+			int r;
+
+			if (!warm) drop_cache(path);
+
+			t0 = now_ns();
+			if (mode == SCAN_MMAP || mode == SCAN_MMAP_HUGE)
+				r = scan_mmap(path, mode == SCAN_MMAP_HUGE, &lines);
+			else
+				r = scan_read(path, mode == SCAN_DIRECT, bufsize, &lines);
+			t0 = now_ns() - t0;
+
+			if (r == -1) {
+				fprintf(stderr, "%s: skipped (%s)\n", mode_names[mode],
+					strerror(errno));
+				break;
+			}
+
+			/* every way had better find the same number of lines */
+			if (expect == 0) expect = lines;
+			if (lines != expect)
+				fprintf(stderr, "%s: counted %lu lines, not %lu!\n",
+					mode_names[mode], lines, expect);
+
+			snprintf(mech, sizeof mech, "%s_%s", mode_names[mode],
+				warm ? "warm" : "cold");
+			bench_csv_row(mech, sb.st_size, 1, t0, NULL);
+			fflush(stdout);
+		}
+	}
+
+	fprintf(stderr, "%s: %lld bytes, %lu lines\n", path,
+		(long long)sb.st_size, expect);
+
+	if (scratch) unlink(path);
+
+	return 0;
+}
+
+#endif
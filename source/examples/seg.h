@@ -0,0 +1,352 @@
+/*
+** seg.h -- make a shared memory segment, the shmdemo.c way (shmget()),
+** the mmap_anon.c way (MAP_SHARED|MAP_ANONYMOUS), or by mapping a file,
+** optionally backed by huge pages and placed on a given NUMA node
+**
+** With 4K pages, every 4K of a big segment needs its own TLB entry, and
+** random access to gigabytes of it spends much of its time on TLB
+** misses.  A 2M page covers 512 times as much; a 1G page, 262144 times.
+**
+** Huge pages (hugetlb) come out of a pool the admin sets aside:
+**
+**   echo 512 > /proc/sys/vm/nr_hugepages                 (2M pages)
+**   echo 2 > /sys/kernel/mm/hugepages/hugepages-1048576kB/nr_hugepages
+**
+** If the pool's empty, or the size isn't supported, seg_create() falls
+** back to normal pages and asks for transparent huge pages instead (the
+** kernel may or may not oblige).  seg->how says what we ended up with.
+**
+** Linux only.
+*/
+
+#ifndef SEG_H
+#define SEG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT 26
+#endif
+
+#define SEG_MAX_NODES 1024  /* sizes of the node and CPU masks, in bits */
+#define SEG_MAX_CPUS 4096
+#define SEG_LONG_BITS (8 * sizeof(unsigned long))
+
+enum seg_type {
+	SEG_ANON,  /* mmap(MAP_SHARED|MAP_ANONYMOUS), shared with children */
+	SEG_SYSV,  /* shmget()/shmat() */
+	SEG_FILE,  /* mmap() of a file, e.g. on a hugetlbfs mount */
+};
+
+/* page sizes we can ask for */
+#define SEG_PAGE_NORMAL 0
+#define SEG_PAGE_2M (2ul << 20)
+#define SEG_PAGE_1G (1ul << 30)
+
+struct seg {
+	void *addr;
+	size_t size;       /* rounded up to a whole number of pages */
+	size_t pagesize;   /* what we got */
+	int type;
+	int shmid;         /* SEG_SYSV */
+	int fallback;      /* asked for huge pages, didn't get them */
+	char how[96];      /* e.g. "anon, 2M hugetlb" */
+};
+
+static const char *seg_type_name[] = { "anon", "sysv", "file" };
+
+static inline int seg_log2(size_t n)
+{
+	int b = 0;
+
+	while (n >>= 1) b++;
+
+	return b;
+}
+
+/*
+** seg_pages() -- "2M", "1G" and so on, for messages
+*/
+static inline const char *seg_pages(size_t pagesize, char *buf, size_t n)
+{
+	if (pagesize >= SEG_PAGE_1G)
+		snprintf(buf, n, "%zuG", pagesize >> 30);
+	else if (pagesize >= (1ul << 20))
+		snprintf(buf, n, "%zuM", pagesize >> 20);
+	else
+		snprintf(buf, n, "%zuK", pagesize >> 10);
+
+	return buf;
+}
+
+static inline size_t seg_round(size_t size, size_t pagesize)
+{
+	return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
+static inline void *seg_map_huge(struct seg *s, size_t pagesize)
+{
+	void *p;
+
+	s->size = seg_round(s->size, pagesize);
+	p = mmap(NULL, s->size, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS|MAP_HUGETLB |
+		(seg_log2(pagesize) << MAP_HUGE_SHIFT), -1, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static inline void *seg_shm_huge(struct seg *s, key_t key, size_t pagesize)
+{
+	void *p;
+
+	s->size = seg_round(s->size, pagesize);
+	s->shmid = shmget(key, s->size, IPC_CREAT | 0600 | SHM_HUGETLB |
+		(seg_log2(pagesize) << SHM_HUGE_SHIFT));
+	if (s->shmid == -1) return NULL;
+
+	if ((p = shmat(s->shmid, NULL, 0)) == (void *)-1) {
+		shmctl(s->shmid, IPC_RMID, NULL);
+		return NULL;
+	}
+
+	return p;
+}
+
+/*
+** seg_create() -- make a segment of at least size bytes.
+**
+** type is one of enum seg_type; pagesize is SEG_PAGE_NORMAL, SEG_PAGE_2M
+** or SEG_PAGE_1G.  key is for SEG_SYSV (IPC_PRIVATE is fine) and path
+** is for SEG_FILE: a file on a hugetlbfs mount gets that mount's huge
+** pages whatever pagesize says.
+**
+** Returns 0, or -1 with errno set if even normal pages didn't work.
+*/
+static inline int seg_create(struct seg *s, int type, size_t size,
+	size_t pagesize, key_t key, const char *path)
+{
+	size_t normal = sysconf(_SC_PAGESIZE), got = normal;
+	char want_s[16], got_s[16];
+	struct stat sb;
+	void *p;
+	int fd;
+
+	memset(s, 0, sizeof *s);
+	s->type = type;
+	s->size = size;
+	s->shmid = -1;
+
+	switch (type) {
+		case SEG_ANON:
+			if (pagesize > normal && (p = seg_map_huge(s, pagesize)) != NULL) {
+				got = pagesize;
+				break;
+			}
+			s->size = seg_round(size, normal);
+			p = mmap(NULL, s->size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) return -1;
+			break;
+
+		case SEG_SYSV:
+			if (pagesize > normal && (p = seg_shm_huge(s, key, pagesize)) != NULL) {
+				got = pagesize;
+				break;
+			}
+			s->size = seg_round(size, normal);
+			if ((s->shmid = shmget(key, s->size, IPC_CREAT | 0600)) == -1)
+				return -1;
+			if ((p = shmat(s->shmid, NULL, 0)) == (void *)-1) return -1;
+			break;
+
+		case SEG_FILE:
+			if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1) return -1;
+
+			/* on hugetlbfs, st_blksize is the mount's huge page size */
+			if (fstat(fd, &sb) == 0 && (size_t)sb.st_blksize > normal)
+				got = pagesize = sb.st_blksize;
+			s->size = seg_round(size, got);
+
+			if (ftruncate(fd, s->size) == -1 ||
+			    (p = mmap(NULL, s->size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			    fd, 0)) == MAP_FAILED) {
+				int e = errno;
+				close(fd);
+				errno = e;
+				return -1;
+			}
+			close(fd);  /* the mapping keeps the file open */
+			break;
+
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	s->addr = p;
+	s->pagesize = got;
+	seg_pages(got, got_s, sizeof got_s);
+
+	if (got < pagesize) {
+		s->fallback = 1;
+		madvise(p, s->size, MADV_HUGEPAGE);  /* worth a try */
+		snprintf(s->how, sizeof s->how, "%s, %s (no %s huge pages), THP "
+			"advised", seg_type_name[type], got_s,
+			seg_pages(pagesize, want_s, sizeof want_s));
+	} else {
+		snprintf(s->how, sizeof s->how, "%s, %s%s", seg_type_name[type],
+			got_s, got > normal ? " hugetlb" : "");
+	}
+
+	return 0;
+}
+
+/*
+** seg_destroy() -- unmap the segment and, for SEG_SYSV, remove it
+*/
+static inline void seg_destroy(struct seg *s)
+{
+	if (s->type == SEG_SYSV) {
+		shmdt(s->addr);
+		shmctl(s->shmid, IPC_RMID, NULL);
+	} else {
+		munmap(s->addr, s->size);
+	}
+
+	s->addr = NULL;
+}
+
+/*
+** NUMA placement.  On a machine with more than one memory node (say,
+** two sockets), memory hangs off one node or the other, and reaching
+** the other node's memory takes longer.  A page normally lands on the
+** node of whichever CPU touches it first; seg_bind() says where a
+** segment's pages go no matter who touches them, and seg_pin() keeps a
+** process on a node's CPUs.  (set_mempolicy() does what seg_bind() does,
+** but for everything a process allocates from then on.)
+**
+** These are raw system calls, so there's no need for libnuma.
+*/
+
+/*
+** seg_parse_list() -- turn a list like "0-3,8-11" (the format of the
+** files in /sys/devices/system/node) into a bit mask.  Returns the
+** highest number in the list, or -1.
+*/
+static inline int seg_parse_list(const char *path, unsigned long *mask,
+	int maxbits)
+{
+	char buf[1024], *p;
+	int hi = -1;
+	FILE *fp;
+
+	memset(mask, 0, maxbits / 8);
+
+	if ((fp = fopen(path, "r")) == NULL) return -1;
+	if (fgets(buf, sizeof buf, fp) == NULL) buf[0] = '\0';
+	fclose(fp);
+
+	for (p = buf; *p >= '0' && *p <= '9'; ) {
+		int lo = strtol(p, &p, 10), top = lo, i;
+
+		if (*p == '-') top = strtol(p + 1, &p, 10);
+		for (i = lo; i <= top && i < maxbits; i++) {
+			mask[i / SEG_LONG_BITS] |= 1ul << (i % SEG_LONG_BITS);
+			hi = i;
+		}
+		if (*p == ',') p++;
+	}
+
+	return hi;
+}
+
+/*
+** seg_node_online() -- is this memory node there at all?
+*/
+static inline int seg_node_online(int node)
+{
+	unsigned long mask[SEG_MAX_NODES / SEG_LONG_BITS];
+
+	if (node < 0 || node >= SEG_MAX_NODES ||
+	    seg_parse_list("/sys/devices/system/node/online", mask,
+	    SEG_MAX_NODES) == -1)
+		return node == 0;  /* no NUMA support: everything's node 0 */
+
+	return (mask[node / SEG_LONG_BITS] >> (node % SEG_LONG_BITS)) & 1;
+}
+
+/*
+** seg_bind() -- put the segment's pages on node.  Do it before anything
+** touches them; pages already touched are moved if they can be.
+*/
+static inline int seg_bind(struct seg *s, int node)
+{
+	unsigned long mask[SEG_MAX_NODES / SEG_LONG_BITS];
+
+	if (node < 0 || node >= SEG_MAX_NODES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(mask, 0, sizeof mask);
+	mask[node / SEG_LONG_BITS] = 1ul << (node % SEG_LONG_BITS);
+
+	return syscall(SYS_mbind, s->addr, s->size, MPOL_BIND, mask,
+		SEG_MAX_NODES + 1, MPOL_MF_MOVE | MPOL_MF_STRICT);
+}
+
+/*
+** seg_node_of() -- which node the page at addr is on (touch it first),
+** or -1 if we can't tell
+*/
+static inline int seg_node_of(void *addr)
+{
+	int node;
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+	    MPOL_F_NODE | MPOL_F_ADDR) == -1)
+		return -1;
+
+	return node;
+}
+
+/*
+** seg_pin() -- run process pid (0 for us) only on node's CPUs
+*/
+static inline int seg_pin(pid_t pid, int node)
+{
+	unsigned long mask[SEG_MAX_CPUS / SEG_LONG_BITS];
+	char path[64];
+
+	snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist",
+		node);
+
+	if (seg_parse_list(path, mask, SEG_MAX_CPUS) == -1) {
+		if (node != 0) {
+			errno = ENOENT;
+			return -1;
+		}
+		memset(mask, 0xff, sizeof mask);  /* no NUMA: any CPU will do */
+	}
+
+	return syscall(SYS_sched_setaffinity, pid, sizeof mask, mask);
+}
+
+#endif
@@ -0,0 +1,161 @@
+/*
+** seminit.h -- get a semaphore set up without semdemo.c's waiting
+**
+** semdemo.c's initsem() (after Stevens) has everyone but the creator
+** poll sem_otime once a second until the creator has done a semop(), so
+** a latecomer can sit for a full second waiting on a set that was ready
+** a microsecond after it looked.  Here are two ways that don't poll:
+**
+** initsem_gate() makes the set with one extra "gate" semaphore.  A new
+** set starts out all zeroes on Linux, so the gate is shut.  The creator
+** sets the real semaphores with SETALL and then opens the gate with a
+** semop().  Everyone else waits for the gate in a semtimedop() that
+** takes one from it and puts it right back, all in one atomic call, so
+** they're woken the moment it opens.  If the creator dies before it
+** does, they time out with ETIME rather than waiting forever.
+**
+** psem_open() puts a process-shared POSIX sem_t in a small file that
+** everyone maps.  The creator builds the file under a temporary name,
+** runs sem_init() on it, and only then link()s it into place, so
+** nobody can ever see it half made.  (glibc's sem_open() does the same
+** thing in /dev/shm.)
+**
+** Linux only, for semtimedop().
+*/
+
+#ifndef SEMINIT_H
+#define SEMINIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/mman.h>
+
+/*
+** initsem_gate() -- get the nsems semaphore set for key, each set to
+** val, making it if need be.  The gate is semaphore number nsems; leave
+** it alone.  timeout bounds the wait for someone else's creator, or is
+** NULL to wait as long as it takes.  Returns the semid, or -1 with errno
+** set on error.
+*/
+static inline int initsem_gate(key_t key, int nsems, int val,
+	const struct timespec *timeout)
+{
+	struct sembuf open_gate = { 0 };
+	struct sembuf wait_gate[2] = { { 0 }, { 0 } };
+	unsigned short vals[nsems + 1];
+	union { int val; unsigned short *array; } arg;  /* union semun, cut down */
+	int i, semid;
+
+	open_gate.sem_num = nsems;
+	open_gate.sem_op = 1;
+	wait_gate[0].sem_num = wait_gate[1].sem_num = nsems;
+	wait_gate[0].sem_op = -1;  /* blocks while the gate is shut... */
+	wait_gate[1].sem_op = 1;   /* ...and leaves it as it was */
+
+	for (;;) {
+		semid = semget(key, nsems + 1, IPC_CREAT | IPC_EXCL | 0666);
+
+		if (semid >= 0) { /* we got it first */
+			for (i = 0; i < nsems; i++) vals[i] = val;
+			vals[nsems] = 0;
+			arg.array = vals;
+
+			if (semctl(semid, 0, SETALL, arg) == -1 ||
+			    semop(semid, &open_gate, 1) == -1) {
+				int e = errno;
+				semctl(semid, 0, IPC_RMID); /* clean up */
+				errno = e;
+				return -1;
+			}
+
+			return semid;
+		}
+
+		if (errno != EEXIST) return -1;
+
+		/* someone else got it first; wait for them to open the gate */
+		if ((semid = semget(key, nsems + 1, 0)) == -1) {
+			if (errno == ENOENT) continue;  /* and then removed it */
+			return -1;
+		}
+
+		if (semtimedop(semid, wait_gate, 2, timeout) == 0)
+			return semid;
+
+		if (errno == EIDRM) continue;  /* removed while we waited */
+		if (errno == EAGAIN) errno = ETIME;
+
+		return -1;
+	}
+}
+
+/*
+** psem_open() -- map the POSIX semaphore kept in path, making it with
+** value val if it isn't there yet.  Returns NULL with errno set on
+** error.
+*/
+static inline sem_t *psem_open(const char *path, unsigned val)
+{
+	char tmp[4096];
+	sem_t *sem;
+	int fd, e;
+
+	if ((size_t)snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	for (;;) {
+		if ((fd = open(path, O_RDWR)) != -1) {
+			sem = mmap(NULL, sizeof *sem, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+			e = errno;
+			close(fd);
+			errno = e;
+			return sem == MAP_FAILED ? NULL : sem;
+		}
+		if (errno != ENOENT) return NULL;
+
+		/* not there; build one off to the side */
+		snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+		if ((fd = mkstemp(tmp)) == -1) return NULL;
+
+		if (ftruncate(fd, sizeof *sem) == -1 ||
+		    (sem = mmap(NULL, sizeof *sem, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			e = errno;
+			close(fd);
+			unlink(tmp);
+			errno = e;
+			return NULL;
+		}
+		close(fd);
+
+		if (sem_init(sem, 1, val) == -1 || link(tmp, path) == -1) {
+			e = errno;
+			munmap(sem, sizeof *sem);
+			unlink(tmp);
+			if (e == EEXIST) continue;  /* lost the race; use theirs */
+			errno = e;
+			return NULL;
+		}
+
+		unlink(tmp);
+		return sem;
+	}
+}
+
+static inline void psem_close(sem_t *sem)
+{
+	munmap(sem, sizeof *sem);
+}
+
+#endif
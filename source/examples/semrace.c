@@ -0,0 +1,291 @@
+/*
+** semrace.c -- 100 processes race to get one semaphore set up and take
+** it, four ways:
+**
+**   stevens       semdemo.c's initsem(), minus the "press return"
+**   sysv_gate     seminit.h's initsem_gate()
+**   posix_mapped  seminit.h's psem_open()
+**   posix_named   sem_open() with O_CREAT
+**
+** The children all start at once.  Each one times how long it takes to
+** get the semaphore and lock and unlock it, and the whole round is timed
+** from the start to the last child done.  Prints CSV (see bench.h) with
+** one "message" per process and the per-process latencies; the stevens
+** round's tail is whoever lost the race and slept a second.
+**
+** usage: semrace [-n procs] [-r rounds]
+*/
+
+#ifndef __linux__
+#warning "semrace needs Linux semtimedop()."
+int main(void) {}
+#else
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "seminit.h"
+
+#define MAX_RETRIES 10
+#define DEFAULT_PROCS 100
+#define KEY_FILE "semrace.dat"
+#define PSEM_FILE "semrace.sem"
+#define PSEM_NAME "/semrace"
+
+enum { STEVENS, SYSV_GATE, POSIX_MAPPED, POSIX_NAMED, NMODES };
+
+static const char *mode_names[] = {
+	"stevens", "sysv_gate", "posix_mapped", "posix_named"
+};
+
+/*
+** initsem() -- semdemo.c's, with the getchar() taken out
+*/
+static int initsem(key_t key, int nsems)  /* key from ftok() */
+{
+	int i;
+	union { int val; struct semid_ds *buf; } arg;  /* union semun, cut down */
+	struct semid_ds buf;
+	struct sembuf sb = { 0 };
+	int semid;
+
+	semid = semget(key, nsems, IPC_CREAT | IPC_EXCL | 0666);
+
+	if (semid >= 0) { /* we got it first */
+		sb.sem_op = 1; sb.sem_flg = 0;
+
+		for(sb.sem_num = 0; sb.sem_num < nsems; sb.sem_num++) {
+			/* do a semop() to "free" the semaphores. */
+			/* this sets the sem_otime field, as needed below. */
+			if (semop(semid, &sb, 1) == -1) {
+				int e = errno;
+				semctl(semid, 0, IPC_RMID); /* clean up */
+				errno = e;
+				return -1; /* error, check errno */
+			}
+		}
+	} else if (errno == EEXIST) { /* someone else got it first */
+		int ready = 0;
+
+		semid = semget(key, nsems, 0); /* get the id */
+		if (semid < 0) return semid; /* error, check errno */
+
+		/* wait for other process to initialize the semaphore: */
+		arg.buf = &buf;
+		for(i = 0; i < MAX_RETRIES && !ready; i++) {
+			semctl(semid, nsems-1, IPC_STAT, arg);
+			if (arg.buf->sem_otime != 0) {
+				ready = 1;
+			} else {
+				sleep(1);
+			}
+		}
+		if (!ready) {
+			errno = ETIME;
+			return -1;
+		}
+	} else {
+		return semid; /* error, check errno */
+	}
+
+	return semid;
+}
+
+/*
+** take() -- get the semaphore the given way, and lock and unlock it
+*/
+static void take(int mode, key_t key)
+{
+	struct sembuf sb = { 0, -1, SEM_UNDO };
+	struct timespec timeout = { 5, 0 };
+	sem_t *sem;
+	int semid;
+
+	switch (mode) {
+		case STEVENS:
+		case SYSV_GATE:
+			semid = mode == STEVENS ? initsem(key, 1) :
+				initsem_gate(key, 1, 1, &timeout);
+			if (semid == -1) {
+				perror("initsem");
+				exit(1);
+			}
+
+			if (semop(semid, &sb, 1) == -1) {
+				perror("semop");
+				exit(1);
+			}
+			sb.sem_op = 1;
+			if (semop(semid, &sb, 1) == -1) {
+				perror("semop");
+				exit(1);
+			}
+			break;
+
+		case POSIX_MAPPED:
+		case POSIX_NAMED:
+			sem = mode == POSIX_MAPPED ? psem_open(PSEM_FILE, 1) :
+				sem_open(PSEM_NAME, O_CREAT, 0600, 1);
+			if (sem == NULL || sem == SEM_FAILED) {
+				perror("sem_open");
+				exit(1);
+			}
+
+			while (sem_wait(sem) == -1)
+				if (errno != EINTR) {
+					perror("sem_wait");
+					exit(1);
+				}
+			sem_post(sem);
+
+			if (mode == POSIX_MAPPED) psem_close(sem);
+			else sem_close(sem);
+			break;
+	}
+}
+
+/*
+** cleanup() -- remove whatever the last round left behind
+*/
+static void cleanup(key_t key)
+{
+	int semid;
+
+	if ((semid = semget(key, 0, 0)) != -1)
+		semctl(semid, 0, IPC_RMID);
+
+	unlink(PSEM_FILE);
+	sem_unlink(PSEM_NAME);
+}
+
+/*
+** run() -- one round with n processes; their latencies go in lat[]
+*/
+static void run(int mode, int n, key_t key, uint64_t *lat)
+{
+	uint64_t start, *done = lat + n;
+	int i, status, go[2];
+	struct lat l;
+	char name[64], c;
+
+	cleanup(key);
+
+	if (pipe(go) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		switch (fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0: {
+				uint64_t t0;
+
+				close(go[1]);
+				read(go[0], &c, 1);  /* EOF when the parent says go */
+
+				t0 = now_ns();
+				take(mode, key);
+				done[i] = now_ns();
+				lat[i] = done[i] - t0;
+				_exit(0);
+			}
+		}
+	}
+
+	close(go[0]);
+	usleep(100000);  /* let them all get to their read() */
+
+	start = now_ns();
+	close(go[1]);
+
+	while (wait(&status) != -1)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "semrace: a child failed\n");
+			exit(1);
+		}
+
+	lat_init(&l, n);
+	for (i = 0; i < n; i++) {
+		lat_add(&l, lat[i]);
+		if (done[i] > done[0]) done[0] = done[i];
+	}
+
+	snprintf(name, sizeof name, "%s_%dp", mode_names[mode], n);
+	bench_csv_row(name, 0, n, done[0] - start, &l);
+	fflush(stdout);
+
+	lat_sort(&l);
+	fprintf(stderr, "%s: all attached in %.1f us, slowest took %.1f us\n",
+		name, (done[0] - start) / 1000.0, l.ns[l.n - 1] / 1000.0);
+	lat_free(&l);
+
+	cleanup(key);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, fd, mode, r, n = DEFAULT_PROCS, rounds = 1;
+	uint64_t *lat;
+	key_t key;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+			case 'n': n = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: semrace [-n procs] [-r rounds]\n");
+				exit(1);
+		}
+	}
+
+	if (n <= 0) n = 1;
+
+	if ((fd = open(KEY_FILE, O_RDONLY | O_CREAT, 0644)) == -1) {
+		perror(KEY_FILE);
+		exit(1);
+	}
+	close(fd);
+
+	if ((key = ftok(KEY_FILE, 'R')) == -1) {
+		perror("ftok");
+		exit(1);
+	}
+
+	/* each child's latency, then when it finished */
+	lat = mmap(NULL, 2 * n * sizeof *lat, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (lat == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (r = 0; r < rounds; r++)
+		for (mode = STEVENS; mode < NMODES; mode++)
+			run(mode, n, key, lat);
+
+	munmap(lat, 2 * n * sizeof *lat);
+	unlink(KEY_FILE);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+** seqlock.h -- one writer publishes snapshots to shared memory, and
+** any number of readers take consistent copies without ever writing
+** to the shared memory themselves
+**
+** The writer makes the sequence number odd, updates the data, then
+** makes it even again.  A reader notes the sequence number, copies the
+** data, and looks at the sequence number again: if it was odd, or it
+** changed, the copy might be torn and the reader goes around again.
+**
+** Readers never store anything, so they never steal a cache line from
+** each other or from the writer; a read costs the misses on the lines
+** it copies and not much else.  There must only be one writer (or the
+** writers need a lock of their own).
+*/
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define SEQLOCK_YIELD 64  /* retries between sched_yield()s */
+
+struct seqlock {
+	_Atomic uint32_t seq;
+};
+
+static inline void seqlock_init(struct seqlock *sl)
+{
+	atomic_init(&sl->seq, 0);
+}
+
+/*
+** The data is copied a word at a time with relaxed atomics, so the
+** race between a reader and the writer is one C11 allows; the fences
+** and the sequence number do the rest.  n is in bytes, a multiple of 8,
+** and both buffers need 8-byte alignment.
+*/
+static inline void seqlock_store(void *dst, const void *src, size_t n)
+{
+	_Atomic uint64_t *d = dst;
+	const uint64_t *s = src;
+	size_t i;
+
+	for (i = 0; i < n / 8; i++)
+		atomic_store_explicit(&d[i], s[i], memory_order_relaxed);
+}
+
+static inline void seqlock_load(void *dst, const void *src, size_t n)
+{
+	uint64_t *d = dst;
+	_Atomic uint64_t *s = (_Atomic uint64_t *)src;
+	size_t i;
+
+	for (i = 0; i < n / 8; i++)
+		d[i] = atomic_load_explicit(&s[i], memory_order_relaxed);
+}
+
+/*
+** seqlock_publish() -- the writer's side: copy n bytes from src into
+** the shared dst
+*/
+static inline void seqlock_publish(struct seqlock *sl, void *dst,
+	const void *src, size_t n)
+{
+	uint32_t seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&sl->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);  /* odd before the data */
+
+	seqlock_store(dst, src, n);
+
+	atomic_store_explicit(&sl->seq, seq + 2, memory_order_release);
+}
+
+/*
+** seqlock_snapshot() -- the reader's side: copy n bytes of the shared
+** src into dst.  Returns how many times it had to retry.
+*/
+static inline unsigned long seqlock_snapshot(struct seqlock *sl, void *dst,
+	const void *src, size_t n)
+{
+	unsigned long retries = 0;
+	uint32_t s1, s2;
+
+	for (;;) {
+		s1 = atomic_load_explicit(&sl->seq, memory_order_acquire);
+
+		if (!(s1 & 1)) {
+			seqlock_load(dst, src, n);
+			atomic_thread_fence(memory_order_acquire);  /* data before s2 */
+			s2 = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+
+			if (s1 == s2) return retries;
+		}
+
+		/* if the writer got preempted mid-update, spinning won't help */
+		if (++retries % SEQLOCK_YIELD == 0) sched_yield();
+	}
+}
+
+#endif
@@ -0,0 +1,245 @@
+/*
+** shmseq.c -- shmdemo.c, with the segment published under a seqlock
+** (see seqlock.h) so readers can never see a half-written string
+**
+** usage: shmseq [data_to_write]
+**        shmseq -b [-r max_readers] [-t ms] [-w writer_interval_us]
+**
+** -b is a benchmark: one writer republishes the segment every so often
+** (-w 0 for nonstop) while 1, 2, 4, ... readers take snapshots.  For
+** comparison, "unsync" does what shmdemo.c does and just copies, torn
+** or not.  Prints CSV (see bench.h) and, on stderr, retries and torn
+** copies per reader.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "bench.h"
+#include "seqlock.h"
+
+#define SHM_SIZE 1024  /* the same 1K as shmdemo.c */
+#define MAX_READERS 64
+#define CACHELINE 64
+
+struct segment {
+	struct seqlock lock;
+	_Alignas(CACHELINE) char data[SHM_SIZE];
+};
+
+/* the benchmark's extras, in their own segment */
+struct control {
+	_Atomic int ready, go, stop;
+	struct {
+		_Alignas(CACHELINE) unsigned long reads, retries, torn;
+	} reader[MAX_READERS];
+};
+
+static struct segment *seg;
+static struct control *ctl;
+
+static void *attach(key_t key, size_t size)
+{
+	int shmid;
+	void *p;
+
+	if ((shmid = shmget(key, size, 0644 | IPC_CREAT)) == -1) {
+		perror("shmget");
+		exit(1);
+	}
+
+	p = shmat(shmid, (void *)0, 0);
+	if (p == (void *)(-1)) {
+		perror("shmat");
+		exit(1);
+	}
+
+	if (key == IPC_PRIVATE)
+		shmctl(shmid, IPC_RMID, NULL);  /* gone once everyone detaches */
+
+	return p;
+}
+
+static void wait_for_go(void)
+{
+	atomic_fetch_add(&ctl->ready, 1);
+	while (!atomic_load(&ctl->go))
+		sched_yield();
+}
+
+/*
+** The writer fills the string with one letter, so a copy with two
+** different letters in it is torn.
+*/
+static void writer(unsigned interval_us)
+{
+	_Alignas(8) char buf[SHM_SIZE];
+	unsigned long n = 0;
+
+	wait_for_go();
+
+	while (!atomic_load_explicit(&ctl->stop, memory_order_relaxed)) {
+		memset(buf, 'a' + n++ % 26, SHM_SIZE - 1);
+		buf[SHM_SIZE - 1] = '\0';
+		seqlock_publish(&seg->lock, seg->data, buf, SHM_SIZE);
+
+		if (interval_us > 0) usleep(interval_us);
+	}
+}
+
+static void reader(int id, int sync)
+{
+	_Alignas(8) char copy[SHM_SIZE];
+	unsigned long reads = 0, retries = 0, torn = 0;
+
+	wait_for_go();
+
+	while (!atomic_load_explicit(&ctl->stop, memory_order_relaxed)) {
+		if (sync)
+			retries += seqlock_snapshot(&seg->lock, copy, seg->data, SHM_SIZE);
+		else
+			seqlock_load(copy, seg->data, SHM_SIZE);
+
+		if (copy[0] != copy[SHM_SIZE - 2]) torn++;
+		reads++;
+	}
+
+	ctl->reader[id].reads = reads;
+	ctl->reader[id].retries = retries;
+	ctl->reader[id].torn = torn;
+}
+
+static void run(int nreaders, int sync, unsigned ms, unsigned interval_us)
+{
+	unsigned long reads = 0, retries = 0, torn = 0;
+	uint64_t elapsed;
+	char name[64];
+	int i, status;
+
+	memset(ctl, 0, sizeof *ctl);
+	seqlock_init(&seg->lock);
+	memset(seg->data, 'a', SHM_SIZE - 1);
+
+	for (i = 0; i <= nreaders; i++) {
+		switch (fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0:
+				if (i < nreaders) reader(i, sync);
+				else writer(interval_us);
+				_exit(0);
+		}
+	}
+
+	while (atomic_load(&ctl->ready) < nreaders + 1)
+		sched_yield();
+
+	elapsed = now_ns();
+	atomic_store(&ctl->go, 1);
+	usleep(ms * 1000);
+	atomic_store(&ctl->stop, 1);
+
+	while (wait(&status) != -1)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "shmseq: a child failed\n");
+			exit(1);
+		}
+	elapsed = now_ns() - elapsed;
+
+	for (i = 0; i < nreaders; i++) {
+		reads += ctl->reader[i].reads;
+		retries += ctl->reader[i].retries;
+		torn += ctl->reader[i].torn;
+	}
+
+	snprintf(name, sizeof name, "%s_%dr", sync ? "seqlock" : "unsync",
+		nreaders);
+	bench_csv_row(name, SHM_SIZE, reads, elapsed, NULL);
+	fflush(stdout);
+
+	fprintf(stderr, "%s: %.3f retries per read, %lu torn copies\n", name,
+		reads ? (double)retries / reads : 0.0, torn);
+}
+
+int main(int argc, char *argv[])
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, n, bench = 0, max_readers = 0;
+	unsigned ms = 300, interval_us = 1000;
+	_Alignas(8) char buf[SHM_SIZE];
+	key_t key;
+
+	while ((opt = getopt(argc, argv, "br:t:w:")) != -1) {
+		switch (opt) {
+			case 'b': bench = 1; break;
+			case 'r': max_readers = atoi(optarg); break;
+			case 't': ms = strtoul(optarg, NULL, 0); break;
+			case 'w': interval_us = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: shmseq [data_to_write]\n"
+					"       shmseq -b [-r max_readers] [-t ms] "
+					"[-w writer_interval_us]\n");
+				exit(1);
+		}
+	}
+
+	if (bench) {
+		if (max_readers <= 0) max_readers = ncpu > 2 ? ncpu : 4;
+		if (max_readers > MAX_READERS) max_readers = MAX_READERS;
+
+		seg = attach(IPC_PRIVATE, sizeof *seg);
+		ctl = attach(IPC_PRIVATE, sizeof *ctl);
+
+		bench_csv_header();
+		fflush(stdout);
+
+		for (n = 1; n <= max_readers; n *= 2) {
+			run(n, 0, ms, interval_us);
+			run(n, 1, ms, interval_us);
+		}
+
+		return 0;
+	}
+
+	if (argc - optind > 1) {
+		fprintf(stderr, "usage: shmseq [data_to_write]\n");
+		exit(1);
+	}
+
+	/* make the key, as shmdemo.c does: */
+	if ((key = ftok("shmseq.c", 'R')) == -1) {
+		perror("ftok");
+		exit(1);
+	}
+
+	/* a new segment is zero-filled: sequence 0, empty string */
+	seg = attach(key, sizeof *seg);
+
+	if (optind < argc) {
+		printf("writing to segment: \"%s\"\n", argv[optind]);
+		memset(buf, 0, sizeof buf);
+		strncpy(buf, argv[optind], SHM_SIZE - 1);
+		seqlock_publish(&seg->lock, seg->data, buf, SHM_SIZE);
+	} else {
+		unsigned long retries = seqlock_snapshot(&seg->lock, buf, seg->data,
+			SHM_SIZE);
+
+		printf("segment contains: \"%s\" (sequence %u, %lu retries)\n", buf,
+			atomic_load(&seg->lock.seq), retries);
+	}
+
+	if (shmdt(seg) == -1) {
+		perror("shmdt");
+		exit(1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,355 @@
+/*
+** spairfd.c -- hands whole buffers across a socketpair() by passing
+** file descriptors (SCM_RIGHTS) instead of bytes
+**
+** The parent fills a memfd_create() buffer, seals it so it can never
+** change again, and sends just the descriptor.  The child maps it and
+** reads the payload in place.  However big the payload, only a few
+** bytes cross the socket.
+**
+** It isn't free, though: a sealed buffer can never be reused, so every
+** handoff pays for a fresh memfd and its pages.  It wins when the data
+** would have been built in a buffer anyway, and the copy through the
+** kernel (twice) is what you're trying to get rid of.
+**
+** usage: spairfd                 (demo, a la spair.c)
+**        spairfd -b [-n count]   (benchmark against copying; CSV)
+*/
+
+#ifndef __linux__
+#warning "spairfd needs Linux memfd_create()."
+int main(void) {}
+#else
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+#define BENCH_MIN (64 * 1024)
+#define BENCH_MAX (64 * 1024 * 1024)
+#define BENCH_BYTES (1024 * 1024 * 1024)
+
+/*
+** send_fd() -- send fd, plus the payload size as ordinary data
+*/
+int send_fd(int sock, int fd, uint64_t size)
+{
+	struct iovec iov = { .iov_base = &size, .iov_len = sizeof size };
+	union {  /* makes sure the control buffer is aligned for cmsghdr */
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctl.buf,
+		.msg_controllen = sizeof ctl.buf,
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+	return sendmsg(sock, &msg, 0) == sizeof size ? 0 : -1;
+}
+
+/*
+** recv_fd() -- the other half.  Returns the new descriptor (a fresh
+** number in this process, same open file) or -1.
+*/
+int recv_fd(int sock, uint64_t *size)
+{
+	struct iovec iov = { .iov_base = size, .iov_len = sizeof *size };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctl.buf,
+		.msg_controllen = sizeof ctl.buf,
+	};
+	struct cmsghdr *cmsg;
+	int fd;
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof *size) return -1;
+
+	/* no descriptor, or one that didn't fit, is as bad as garbage */
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if ((msg.msg_flags & MSG_CTRUNC) || cmsg == NULL ||
+	    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		errno = EBADMSG;
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+
+	return fd;
+}
+
+/*
+** make_payload() -- a sealed memfd of size bytes, all set to val
+*/
+int make_payload(uint64_t size, int val)
+{
+	char *p;
+	int fd;
+
+	if ((fd = memfd_create("payload", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+		return -1;
+
+	if (ftruncate(fd, size) == -1) goto fail;
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		fd, 0);
+	if (p == MAP_FAILED) goto fail;
+	memset(p, val, size);
+	munmap(p, size);  /* F_SEAL_WRITE fails while writable maps exist */
+
+	if (fcntl(fd, F_ADD_SEALS, SEALS) == -1) goto fail;
+
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+/*
+** map_payload() -- map a received payload read-only, after making sure
+** the sender can't change it under us, and that it's as big as the
+** sender says (or reading past its end would get us a SIGBUS)
+*/
+const char *map_payload(int fd, uint64_t size)
+{
+	const char *p;
+	struct stat sb;
+
+	if ((fcntl(fd, F_GET_SEALS) & SEALS) != SEALS) {
+		errno = EPERM;
+		return NULL;
+	}
+
+	if (fstat(fd, &sb) == -1) return NULL;
+	if ((uint64_t)sb.st_size != size) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED|MAP_POPULATE, fd, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static uint64_t sum(const unsigned char *p, size_t n)
+{
+	uint64_t s = 0;
+
+	while (n--) s += *p++;
+
+	return s;
+}
+
+/*
+** bench_run() -- send count payloads of size bytes to the child, by
+** descriptor or by copying them through the socket.  The child sums
+** every byte either way and acks each one.  Returns elapsed ns.
+*/
+static uint64_t bench_run(int by_fd, size_t size, size_t count)
+{
+	int sv[2], status;
+	char *buf = NULL, ack = 0;
+	uint64_t t0;
+	size_t i;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+	if (!by_fd && (buf = malloc(size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	t0 = now_ns();
+
+	switch (pid = fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+
+		case 0:
+			close(sv[0]);
+			for (i = 0; i < count; i++) {
+				const unsigned char *p = (unsigned char *)buf;
+				uint64_t len = size;
+				int fd = -1;
+
+				if (by_fd) {
+					if ((fd = recv_fd(sv[1], &len)) == -1 ||
+					    (p = (const unsigned char *)map_payload(fd, len)) == NULL) {
+						perror("child: payload");
+						_exit(1);
+					}
+				} else if (readn(sv[1], buf, size) != (ssize_t)size) {
+					perror("child: read");
+					_exit(1);
+				}
+
+				if (sum(p, len) != len * (i & 0x7f)) {
+					fprintf(stderr, "child: payload %zu is corrupt\n", i);
+					_exit(1);
+				}
+
+				if (by_fd) {
+					munmap((void *)p, len);
+					close(fd);
+				}
+				if (write(sv[1], &ack, 1) != 1) _exit(1);
+			}
+			_exit(0);
+	}
+
+	close(sv[1]);
+
+	for (i = 0; i < count; i++) {
+		if (by_fd) {
+			int fd = make_payload(size, i & 0x7f);
+
+			if (fd == -1 || send_fd(sv[0], fd, size) == -1) {
+				perror("send payload");
+				exit(1);
+			}
+			close(fd);  /* the child has its own reference now */
+		} else {
+			memset(buf, i & 0x7f, size);
+			if (writen(sv[0], buf, size) == -1) {
+				perror("write");
+				exit(1);
+			}
+		}
+
+		if (read(sv[0], &ack, 1) != 1) {
+			fprintf(stderr, "spairfd: child went away\n");
+			exit(1);
+		}
+	}
+
+	waitpid(pid, &status, 0);
+	t0 = now_ns() - t0;
+
+	close(sv[0]);
+	free(buf);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "spairfd: child failed\n");
+		exit(1);
+	}
+
+	return t0;
+}
+
+static int demo(void)
+{
+	const char *hello = "Hello from a sealed memfd!";
+	int sv[2], fd;
+	uint64_t size;
+	char *p;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	if (!fork()) {  /* child */
+		const char *q;
+
+		if ((fd = recv_fd(sv[1], &size)) == -1) {
+			perror("child: recv_fd");
+			exit(1);
+		}
+		printf("child: got fd %d (%llu bytes), seals 0x%x\n", fd,
+			(unsigned long long)size, fcntl(fd, F_GET_SEALS));
+		if ((q = map_payload(fd, size)) == NULL) {
+			perror("child: map_payload");
+			exit(1);
+		}
+		printf("child: read \"%.*s\"\n", (int)size, q);
+
+	} else { /* parent */
+		size = strlen(hello);
+
+		if ((fd = memfd_create("hello", MFD_ALLOW_SEALING)) == -1 ||
+		    ftruncate(fd, size) == -1 ||
+		    (p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0))
+		    == MAP_FAILED) {
+			perror("memfd");
+			exit(1);
+		}
+		memcpy(p, hello, size);
+		munmap(p, size);
+
+		if (fcntl(fd, F_ADD_SEALS, SEALS) == -1) {
+			perror("F_ADD_SEALS");
+			exit(1);
+		}
+
+		if (send_fd(sv[0], fd, size) == -1) {
+			perror("send_fd");
+			exit(1);
+		}
+		printf("parent: sent fd %d\n", fd);
+		wait(NULL); /* wait for child to die */
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 0, size;
+	int opt, bench = 0;
+
+	while ((opt = getopt(argc, argv, "bn:")) != -1) {
+		switch (opt) {
+			case 'b': bench = 1; break;
+			case 'n': count = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: spairfd [-b [-n count]]\n");
+				exit(1);
+		}
+	}
+
+	if (!bench) return demo();
+
+	bench_csv_header();
+	fflush(stdout);
+
+	for (size = BENCH_MIN; size <= BENCH_MAX; size *= 4) {
+		size_t n = count ? count : bench_count(size, BENCH_BYTES, 8, 2000);
+
+		bench_csv_row("socket_copy", size, n, bench_run(0, size, n), NULL);
+		bench_csv_row("memfd_pass", size, n, bench_run(1, size, n), NULL);
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+** spockbatch.c -- reads from a message queue like spock.c, unpacking
+** the batches that kirkbatch.c sends (plain kirk.c messages work, too)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#include "msgbatch.h"
+
+int main(void)
+{
+	struct batch_msgbuf *msg;
+	size_t max;
+	int msqid;
+	key_t key;
+
+	if ((key = ftok("kirk.c", 'B')) == -1) {  /* same key as kirk.c */
+		perror("ftok");
+		exit(1);
+	}
+
+	if ((msqid = msgget(key, 0644)) == -1) { /* connect to the queue */
+		perror("msgget");
+		exit(1);
+	}
+
+	max = batch_msgmax(msqid);
+	if ((msg = malloc(sizeof *msg + max)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	printf("spock: ready to receive messages, captain.\n");
+
+	for(;;) { /* Spock never quits! */
+		ssize_t mlen = msgrcv(msqid, msg, max, 0, 0);
+
+		if (mlen == -1) {
+			perror("msgrcv");
+			exit(1);
+		}
+
+		if (msg->mtype == BATCH_MTYPE) {
+			size_t off = 0, len;
+			const char *rec;
+			int n = 0;
+
+			while ((rec = batch_next(msg->mtext, mlen, &off, &len)) != NULL) {
+				printf("spock: \"%.*s\"\n", (int)len, rec);
+				n++;
+			}
+			printf("spock: (%d in that batch)\n", n);
+		} else
+			printf("spock: \"%.*s\"\n", (int)mlen, msg->mtext);
+	}
+
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+** spockpool.c -- a pool of spock.c-style receivers on one message
+** queue, each pulling only its own message types
+**
+** Worker i (counting from 0) takes mtype i+1, so a sender can shard
+** work across workers by key; kirkshard.c does that.  With -p every
+** worker instead asks for msgtyp -N, which hands out the lowest type
+** waiting first, so low types act as high priority.
+**
+** usage: spockpool [-w workers] [-p]
+**        spockpool -b [-w maxworkers] [-n msgs]   (benchmark; prints CSV)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#include "bench.h"
+
+#define MAX_WORKERS 64
+#define DEFAULT_WORKERS 4
+#define BENCH_MSGS 200000
+#define BENCH_SIZE 64
+
+struct my_msgbuf {
+	long mtype;
+	char mtext[200];
+};
+
+static pid_t workers[MAX_WORKERS];
+
+static void reap(int n)
+{
+	int i, status, failed = 0;
+
+	for (i = 0; i < n; i++) {
+		waitpid(workers[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+	}
+
+	if (failed) {
+		fprintf(stderr, "spockpool: a worker failed\n");
+		exit(1);
+	}
+}
+
+/*
+** serve() -- the interactive pool: spock.c times N
+*/
+static int serve(int nworkers, int priority)
+{
+	struct my_msgbuf buf;
+	int msqid, i;
+	key_t key;
+
+	if ((key = ftok("kirk.c", 'B')) == -1) {  /* same key as kirk.c */
+		perror("ftok");
+		exit(1);
+	}
+
+	if ((msqid = msgget(key, 0644)) == -1) { /* connect to the queue */
+		perror("msgget");
+		exit(1);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		long msgtyp = priority ? -nworkers : i + 1;
+
+		switch (workers[i] = fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0:
+				printf("spock %d: ready for type %ld, captain.\n", i, msgtyp);
+				for(;;) {
+					if (msgrcv(msqid, &buf, sizeof buf.mtext, msgtyp, 0) == -1) {
+						perror("msgrcv");
+						exit(1);
+					}
+					printf("spock %d: \"%s\" (type %ld)\n", i, buf.mtext,
+						buf.mtype);
+				}
+		}
+	}
+
+	reap(nworkers);
+
+	return 0;
+}
+
+/*
+** bench_run() -- one producer sends n messages round-robin to the
+** workers, either as per-worker types on one shared queue or on a
+** queue per worker.  Returns elapsed ns once every worker has its
+** share.
+*/
+static uint64_t bench_run(int shared, int nworkers, size_t n)
+{
+	struct my_msgbuf buf;
+	int q[MAX_WORKERS], nq = shared ? 1 : nworkers, i;
+	uint64_t t0;
+	size_t j;
+
+	for (i = 0; i < nq; i++)
+		if ((q[i] = msgget(IPC_PRIVATE, 0600 | IPC_CREAT)) == -1) {
+			perror("msgget");
+			exit(1);
+		}
+
+	memset(&buf, 0, sizeof buf);
+	fflush(stdout);
+
+	t0 = now_ns();
+
+	for (i = 0; i < nworkers; i++) {
+		switch (workers[i] = fork()) {
+			case -1:
+				perror("fork");
+				exit(1);
+
+			case 0: {
+				size_t share = n / nworkers + ((size_t)i < n % nworkers);
+				int msqid = shared ? q[0] : q[i];
+				long msgtyp = shared ? i + 1 : 0;
+
+				for (j = 0; j < share; j++)
+					while (msgrcv(msqid, &buf, sizeof buf.mtext, msgtyp, 0) == -1)
+						if (errno != EINTR) {
+							perror("msgrcv");
+							_exit(1);
+						}
+				_exit(0);
+			}
+		}
+	}
+
+	for (j = 0; j < n; j++) {
+		int w = j % nworkers;
+
+		buf.mtype = shared ? w + 1 : 1;
+		while (msgsnd(shared ? q[0] : q[w], &buf, BENCH_SIZE, 0) == -1)
+			if (errno != EINTR) {
+				perror("msgsnd");
+				exit(1);
+			}
+	}
+
+	reap(nworkers);
+	t0 = now_ns() - t0;
+
+	for (i = 0; i < nq; i++)
+		msgctl(q[i], IPC_RMID, NULL);
+
+	return t0;
+}
+
+static int bench(int maxworkers, size_t n)
+{
+	char name[64];
+	int w;
+
+	bench_csv_header();
+
+	for (w = 1; w <= maxworkers; w++) {
+		snprintf(name, sizeof name, "sysv_msg_shared_%dw", w);
+		bench_csv_row(name, BENCH_SIZE, n, bench_run(1, w, n), NULL);
+
+		snprintf(name, sizeof name, "sysv_msg_perworker_%dw", w);
+		bench_csv_row(name, BENCH_SIZE, n, bench_run(0, w, n), NULL);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, nworkers = 0, priority = 0, benchmark = 0;
+	size_t n = BENCH_MSGS;
+
+	while ((opt = getopt(argc, argv, "w:pbn:")) != -1) {
+		switch (opt) {
+			case 'w': nworkers = atoi(optarg); break;
+			case 'p': priority = 1; break;
+			case 'b': benchmark = 1; break;
+			case 'n': n = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: spockpool [-w workers] [-p] | "
+					"spockpool -b [-w maxworkers] [-n msgs]\n");
+				exit(1);
+		}
+	}
+
+	if (nworkers == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nworkers = benchmark && ncpu > 1 ? ncpu : DEFAULT_WORKERS;
+		if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+	}
+
+	if (nworkers < 1 || nworkers > MAX_WORKERS) {
+		fprintf(stderr, "spockpool: workers must be 1-%d\n", MAX_WORKERS);
+		exit(1);
+	}
+
+	return benchmark ? bench(nworkers, n) : serve(nworkers, priority);
+}
@@ -0,0 +1,257 @@
+/*
+** uring.h -- just enough io_uring, on raw system calls, for the echo
+** examples (no liburing needed)
+**
+** We put requests (SQEs) in the submission ring, and one io_uring_enter()
+** both hands them all to the kernel and waits for completions (CQEs) to
+** show up in the completion ring.  A busy program can keep hundreds of
+** operations in flight for one system call per loop.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned sq_entries;
+
+	/* submission ring */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;   /* our tail; the kernel sees it on submit */
+
+	/* completion ring */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned long enters;  /* io_uring_enter() calls, for the curious */
+};
+
+/*
+** A provided-buffer ring: a pool of same-size buffers registered with
+** the kernel.  Multishot receives pick a free one for each chunk of
+** data, and we hand it back when we're done with it.
+*/
+struct uring_bufs {
+	struct io_uring_buf_ring *br;
+	char *base;
+	unsigned nbufs, size;
+	unsigned short bgid, tail;
+};
+
+/*
+** uring_init() -- set up a ring of at least entries SQEs.  Returns -1
+** with errno set on error, having cleaned up after itself.
+*/
+static inline int uring_init(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	size_t sq_len, cq_len;
+	char *sq, *cq = MAP_FAILED;
+	int e;
+
+	memset(&p, 0, sizeof p);
+	memset(u, 0, sizeof *u);
+
+	if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		return -1;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+		sq_len = cq_len;
+
+	sq = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		u->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, cq_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) goto fail;
+	}
+
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd,
+		IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) goto fail;
+
+	u->sq_entries = p.sq_entries;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sqe_tail = *u->sq_tail;
+
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+fail:
+	e = errno;
+	if (cq != MAP_FAILED && cq != sq) munmap(cq, cq_len);
+	if (sq != MAP_FAILED) munmap(sq, sq_len);
+	close(u->fd);
+	errno = e;
+	return -1;
+}
+
+/*
+** uring_enter() -- publish everything we've queued and, if wait is
+** nonzero, block until at least that many completions are ready.
+** Returns -1 with errno set on error (EINTR if a signal came in).
+*/
+static inline int uring_enter(struct uring *u, unsigned wait)
+{
+	unsigned pending;
+
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+	pending = u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	u->enters++;
+
+	return syscall(__NR_io_uring_enter, u->fd, pending, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+** uring_sqe_room() -- make sure the next n uring_sqe() calls won't have
+** to submit anything, submitting what's queued now if they would.  Call
+** it before queueing an IOSQE_IO_LINK chain of n: a chain has to go to
+** the kernel in one piece, or its first half runs unlinked from the
+** rest.  n can't be more than sq_entries.
+*/
+static inline void uring_sqe_room(struct uring *u, unsigned n)
+{
+	while (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >
+	    u->sq_entries - n)
+		if (uring_enter(u, 0) == -1 && errno != EINTR && errno != EAGAIN
+		    && errno != EBUSY) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+}
+
+/*
+** uring_sqe() -- a zeroed SQE to fill in.  If the ring is full we
+** submit what's there first to make room.
+*/
+static inline struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	uring_sqe_room(u, 1);
+
+	i = u->sqe_tail & *u->sq_mask;
+	sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof *sqe);
+	u->sq_array[i] = i;
+	u->sqe_tail++;
+
+	return sqe;
+}
+
+/*
+** uring_cqe() -- the next completion, or NULL if there isn't one yet.
+** Call uring_cqe_seen() when you're done with it.
+*/
+static inline struct io_uring_cqe *uring_cqe(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+** uring_bufs_init() -- register nbufs buffers of size bytes as buffer
+** group bgid.  nbufs must be a power of two.
+*/
+static inline int uring_bufs_init(struct uring *u, struct uring_bufs *b,
+	unsigned nbufs, unsigned size, unsigned short bgid)
+{
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	b->br = mmap(NULL, nbufs * sizeof(struct io_uring_buf),
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (b->br == MAP_FAILED) return -1;
+
+	b->base = mmap(NULL, (size_t)nbufs * size, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (b->base == MAP_FAILED) return -1;
+
+	b->nbufs = nbufs;
+	b->size = size;
+	b->bgid = bgid;
+	b->tail = 0;
+
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uintptr_t)b->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1)
+		return -1;
+
+	for (i = 0; i < nbufs; i++) {
+		struct io_uring_buf *buf = &b->br->bufs[b->tail & (nbufs - 1)];
+
+		buf->addr = (uintptr_t)(b->base + (size_t)i * size);
+		buf->len = size;
+		buf->bid = i;
+		b->tail++;
+	}
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static inline char *uring_buf(struct uring_bufs *b, unsigned bid)
+{
+	return b->base + (size_t)bid * b->size;
+}
+
+/*
+** uring_buf_return() -- give buffer bid back to the kernel.  It can't
+** see it until uring_bufs_publish().
+*/
+static inline void uring_buf_return(struct uring_bufs *b, unsigned bid)
+{
+	struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->nbufs - 1)];
+
+	buf->addr = (uintptr_t)uring_buf(b, bid);
+	buf->len = b->size;
+	buf->bid = bid;
+	b->tail++;
+}
+
+static inline void uring_bufs_publish(struct uring_bufs *b)
+{
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+#endif